@@ -51,12 +51,18 @@
 
 #define gdouble  double
 #define gint     int
+#define gint16   int16_t
 #define gint32   int32_t
+#define guint16  uint16_t
+#define guint32  uint32_t
+#define gint64   int64_t
+#define guint64  uint64_t
 #define gboolean int
 #define guchar   unsigned char
 #define gfloat   float
 #define glong    long
 #define GimpRGBA cv::Vec4d
+#define GimpRGB  cv::Vec3d
 #define GimpHSL  cv::Vec4d
 
 
@@ -84,6 +90,24 @@ gimp_rgba_add (GimpRGBA       & rgba1,
   rgba1[3] += rgba2[3];
 }
 
+inline void
+gimp_rgb_multiply (GimpRGB & rgb,
+                   gdouble   factor)
+{
+  rgb[0] *= factor;
+  rgb[1] *= factor;
+  rgb[2] *= factor;
+}
+
+inline void
+gimp_rgb_add (GimpRGB       & rgb1,
+              const GimpRGB & rgb2)
+{
+  rgb1[0] += rgb2[0];
+  rgb1[1] += rgb2[1];
+  rgb1[2] += rgb2[2];
+}
+
 inline void
 gimp_rgba_clamp (GimpRGBA & rgb)
 {
@@ -93,6 +117,52 @@ gimp_rgba_clamp (GimpRGBA & rgb)
   rgb[3] = CLAMP (rgb[3], 0.0, 1.0);
 }
 
+inline GimpRGB
+gimp_bilinear_rgb (gdouble   x,
+                   gdouble   y,
+                   GimpRGB * values)
+{
+  gdouble m0, m1;
+  gdouble ix, iy;
+  GimpRGB v = { 0, };
+
+  /* Same as fmod (x, 1.0), without the library call */
+
+  x = x - (gdouble) (glong) x;
+  y = y - (gdouble) (glong) y;
+
+  if (x < 0)
+    x += 1.0;
+  if (y < 0)
+    y += 1.0;
+
+  ix = 1.0 - x;
+  iy = 1.0 - y;
+
+  /* Red */
+
+  m0 = ix * values[0][0] + x * values[1][0];
+  m1 = ix * values[2][0] + x * values[3][0];
+
+  v[0] = iy * m0 + y * m1;
+
+  /* Green */
+
+  m0 = ix * values[0][1] + x * values[1][1];
+  m1 = ix * values[2][1] + x * values[3][1];
+
+  v[1] = iy * m0 + y * m1;
+
+  /* Blue */
+
+  m0 = ix * values[0][2] + x * values[1][2];
+  m1 = ix * values[2][2] + x * values[3][2];
+
+  v[2] = iy * m0 + y * m1;
+
+  return v;
+}
+
 inline GimpRGBA
 gimp_bilinear_rgba (gdouble    x,
                     gdouble    y,
@@ -103,8 +173,10 @@ gimp_bilinear_rgba (gdouble    x,
   gdouble a0, a1, a2, a3, alpha;
   GimpRGBA v = { 0, };
 
-  x = fmod (x, 1.0);
-  y = fmod (y, 1.0);
+  /* Same as fmod (x, 1.0), without the library call */
+
+  x = x - (gdouble) (glong) x;
+  y = y - (gdouble) (glong) y;
 
   if (x < 0)
     x += 1.0;
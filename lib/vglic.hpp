@@ -27,6 +27,14 @@
 #define VAN_GOGH_LIC_HPP
 
 #include "libgimpcolor.hpp"
+#include "vglic_fixed.hpp"
+#include "vglic_cache.hpp"
+#include "vglic_pool.hpp"
+
+#include <functional>
+#include <future>
+#include <thread>
+#include <vector>
 
 /*****************************/
 /* Global variables and such */
@@ -55,7 +63,84 @@ typedef enum
   SOURCE_IMAGE
 } ConvolveWith;
 
-static gdouble G[numx][numy][2];
+typedef enum
+{
+  INTERLEAVED,
+  PLANAR
+} ImageLayout;
+
+typedef enum
+{
+  DETECT_ALPHA,
+  OPAQUE,
+  TRANSLUCENT
+} InputAlpha;
+
+typedef enum
+{
+  FLOATING_POINT,
+  FIXED_POINT
+} Arithmetic;
+
+typedef enum
+{
+  MATCH_INPUT,
+  OUTPUT_8U,
+  OUTPUT_16U,
+  OUTPUT_64F
+} OutputDepth;
+
+typedef enum
+{
+  ROUND,
+  ORDERED_DITHER
+} Quantization;
+
+typedef enum
+{
+  ROW_MAJOR,
+  BLOCKED,
+  Z_ORDER
+} Traversal;
+
+typedef enum
+{
+  TILE,
+  STRETCH
+} EffectScaling;
+
+typedef enum
+{
+  DETECT_ISA,
+  ISA_SSE2,
+  ISA_AVX2,
+  ISA_AVX512
+} InstructionSet;
+
+typedef enum
+{
+  STRAIGHT,
+  CURVED
+} Streamline;
+
+/* Arc length of the steps along a CURVED streamline, in pixels */
+
+#define STREAMLINE_MIN_STEP 0.125
+#define STREAMLINE_MAX_STEP 2.0
+
+/* The parameters that differ between the outputs of a multi-output */
+/* compute, see VanGoghLIC::render with a list of variants            */
+
+typedef struct
+{
+  gdouble        filter_length;
+  gdouble        integration_steps;
+  EffectOperator effect_operator;
+} RenderVariant;
+
+/* Sample offsets of variants closer than this, in pixels, are read once */
+
+#define SHARED_OFFSET_TOLERANCE 1e-9
 
 class VanGoghLIC
 {
@@ -69,6 +154,19 @@ public:
   EffectChannel  effect_channel;
   EffectOperator effect_operator;
   ConvolveWith   convolve_with;
+  EffectScaling  effect_scaling;
+  Streamline     streamline;
+  gdouble        streamline_tolerance;
+  ImageLayout    image_layout;
+  InputAlpha     input_alpha;
+  Arithmetic     arithmetic;
+  OutputDepth    output_depth;
+  Quantization   quantization;
+  Traversal      traversal;
+  gint           block_size;
+  gint           num_threads;
+  InstructionSet instruction_set;
+  guint32        dither_seed;
 
 public:
 
@@ -84,6 +182,19 @@ public:
     effect_channel    = BRIGHTNESS;
     effect_operator   = GRADIENT;
     convolve_with     = SOURCE_IMAGE;
+    effect_scaling    = TILE;
+    streamline        = STRAIGHT;
+    streamline_tolerance = 0.05;
+    image_layout      = INTERLEAVED;
+    input_alpha       = DETECT_ALPHA;
+    arithmetic        = FLOATING_POINT;
+    output_depth      = MATCH_INPUT;
+    quantization      = ROUND;
+    traversal         = ROW_MAJOR;
+    block_size        = 0;
+    num_threads       = 1;
+    instruction_set   = DETECT_ISA;
+    dither_seed       = std::mt19937::default_seed;
 
     // private parameters
 
@@ -94,6 +205,17 @@ public:
     maxv   =  2.5;
     isteps = 20.0;
 
+    opaque_alpha = 1.0;
+    render_first = 0;
+    render_last  = 0;
+    render_left  = 0;
+    render_right = 0;
+    effect_width  = 0;
+    effect_height = 0;
+    rendered_samples = 0;
+    rendered_pixels  = 0;
+    pool          = nullptr;
+    pool_priority = PRIORITY_NORMAL;
   }
 
   void
@@ -101,13 +223,362 @@ public:
            cv::Mat & effect_image, 
            cv::Mat & output_image)
   {
-    if (input_image.type() != CV_64FC4)
-      throw std::invalid_argument("VanGoghLIC requires an input_image with type CV_64FC4");
+    prepare (effect_image);
+    render (input_image, output_image, 0, input_image.rows);
+  }
+
+  /* One output per variant, see render below */
+
+  void
+  compute (cv::Mat & input_image,
+           cv::Mat & effect_image,
+           const std::vector<RenderVariant> & variants,
+           std::vector<cv::Mat> & output_images)
+  {
+    prepare (effect_image);
+    render (input_image, variants, output_images, 0, input_image.rows);
+  }
+
+  /******************************************************************/
+  /* compute on the threads of VanGoghLICPool::shared (), returning */
+  /* at once. The output is allocated before the call returns, and  */
+  /* done is called from a pool thread when it is written, with the */
+  /* exception thrown by compute if any. The rows are split into    */
+  /* tasks of POOL_TASK_ROWS rows, which every idle thread of the   */
+  /* process helps with, whatever num_threads says; tasks of higher */
+  /* priority jobs are picked first. The instance and the images    */
+  /* must not be touched until the job is done, so concurrent jobs  */
+  /* need one instance each (copies are fine).                      */
+  /******************************************************************/
+
+  void
+  compute_async (cv::Mat & input_image,
+                 cv::Mat & effect_image,
+                 cv::Mat & output_image,
+                 std::function<void (std::exception_ptr)> done,
+                 TaskPriority priority = PRIORITY_NORMAL)
+  {
+    create_output (input_image, output_image, output_type (input_image.type()));
+
+    cv::Mat input  = input_image;
+    cv::Mat effect = effect_image;
+    cv::Mat output = output_image;
+
+    VanGoghLICPool::shared ().submit (priority, [this, input, effect, output, done, priority] () mutable
+    {
+      std::exception_ptr error;
+
+      pool          = &VanGoghLICPool::shared ();
+      pool_priority = priority;
+
+      try
+      {
+        compute (input, effect, output);
+      }
+      catch (...)
+      {
+        error = std::current_exception ();
+      }
+
+      pool = nullptr;
+
+      done (error);
+    });
+  }
+
+  /* The same, with a future that throws what compute threw */
+
+  std::future<void>
+  compute_async (cv::Mat & input_image,
+                 cv::Mat & effect_image,
+                 cv::Mat & output_image,
+                 TaskPriority priority = PRIORITY_NORMAL)
+  {
+    std::shared_ptr<std::promise<void>> promise (new std::promise<void> ());
+
+    compute_async (input_image, effect_image, output_image, [promise] (std::exception_ptr error)
+    {
+      if (error)
+        promise->set_exception (error);
+      else
+        promise->set_value ();
+    }, priority);
+
+    return promise->get_future ();
+  }
+
+  /**************************************************************/
+  /* compute in two steps, so that the output can be rendered   */
+  /* in bands of rows by different processes. prepare derives   */
+  /* the scalar field from the effect image (or takes one made  */
+  /* elsewhere) and render computes rows first_row to last_row  */
+  /* of the output, leaving the others untouched. Rendering a   */
+  /* band only reads halo_rows () input rows above and below it */
+  /* (wrapping around the image), and every band is identical   */
+  /* to the same rows of a full render.                         */
+  /**************************************************************/
+
+  void
+  prepare (cv::Mat & effect_image)
+  {
+    std::vector<guchar> field;
+
+    compute_scalarfield (effect_image, field);
+    prepare (field, effect_image.cols, effect_image.rows);
+  }
+
+  void
+  prepare (const std::vector<guchar> & field,
+           gint width,
+           gint height)
+  {
+    if (width <= 0 || height <= 0 || field.size () != (size_t) width * height)
+      throw std::invalid_argument("VanGoghLIC requires a scalar field with width * height values");
+
+    scalarfield   = field;
+    effect_width  = width;
+    effect_height = height;
+
+    /* The derivatives are shared by all kernels */
+
+    compute_gradientfield (scalarfield, gradientfield);
+
+    effect_cache.reset ();
+  }
+
+  /************************************************************/
+  /* The prepared fields can be saved to a cache file (see    */
+  /* vglic_cache.hpp) and mapped back later instead of        */
+  /* calling prepare. source_size and source_hash (see        */
+  /* effect_cache_hash) identify the effect image the fields  */
+  /* came from; loading fails, returning false, when they,    */
+  /* effect_channel or dither_seed do not match the file.     */
+  /************************************************************/
+
+  gboolean
+  save_effect_cache (const char * path,
+                     guint64 source_size = 0,
+                     guint64 source_hash = 0)
+  {
+    EffectCacheHeader header;
+
+    if (!is_prepared ())
+      throw std::invalid_argument("VanGoghLIC::save_effect_cache requires a call to prepare first");
+
+    memset (&header, 0, sizeof (header));
+
+    header.magic          = EFFECT_CACHE_MAGIC;
+    header.version        = EFFECT_CACHE_VERSION;
+    header.header_size    = sizeof (header);
+    header.width          = effect_width;
+    header.height         = effect_height;
+    header.effect_channel = effect_channel;
+    header.dither_seed    = dither_seed;
+    header.source_size    = source_size;
+    header.source_hash    = source_hash;
+
+    return effect_cache_write (path, header, scalar_data (), gradient_data ());
+  }
+
+  gboolean
+  load_effect_cache (const char * path,
+                     guint64 source_size = 0,
+                     guint64 source_hash = 0)
+  {
+    std::shared_ptr<EffectCacheMapping> mapping (effect_cache_map (path));
+
+    if (!mapping ||
+        mapping->header->effect_channel != effect_channel ||
+        mapping->header->dither_seed != dither_seed ||
+        mapping->header->source_size != source_size ||
+        mapping->header->source_hash != source_hash)
+      return false;
+
+    scalarfield.clear ();
+    gradientfield.clear ();
+
+    effect_cache  = mapping;
+    effect_width  = mapping->header->width;
+    effect_height = mapping->header->height;
+
+    return true;
+  }
+
+  /* The prepared scalar field, width * height values */
+
+  const guchar *
+  get_scalarfield (gint & width,
+                   gint & height)
+  {
+    width  = effect_width;
+    height = effect_height;
+
+    return scalar_data ();
+  }
+
+  /* The dithered effect_channel of the effect image */
+
+  void
+  compute_scalarfield (cv::Mat & effect_image,
+                       std::vector<guchar> & field)
+  {
+    if (effect_image.type() != CV_64FC4 && effect_image.type() != CV_8UC4)
+      throw std::invalid_argument("VanGoghLIC requires an effect_image with type CV_64FC4 or CV_8UC4");
+
+    if (effect_image.type() == CV_8UC4)
+      effect_image.convertTo (effect_64f, CV_64FC4, 1.0 / 255.0);
+    else
+      effect_64f = effect_image;
+
+    if (effect_channel != HUE && effect_channel != SATURATION && effect_channel != BRIGHTNESS)
+      throw std::invalid_argument("Invalid value for effect_channel");
+
+    rgb_to_hsl (effect_64f, effect_channel, field);
+
+    effect_64f.release ();
+  }
+
+  /* Input rows read above and below a band, for the current filter_length */
+
+  gint
+  halo_rows (void)
+  {
+    return (gint) ceil (MAX (filter_length, 0.1)) + 2;
+  }
+
+  /* The input samples read per output pixel by the last render, */
+  /* the center one included. Fixed with STRAIGHT streamlines,    */
+  /* with CURVED ones it depends on how much the flow bends. For  */
+  /* a render of variants, over the pixels of all their outputs,  */
+  /* so samples fetched once for several variants lower it.       */
+
+  gdouble
+  samples_per_pixel (void)
+  {
+    if (rendered_pixels == 0)
+      return 0.0;
+
+    return (gdouble) rendered_samples / rendered_pixels;
+  }
+
+  /* input_alpha with DETECT_ALPHA resolved for the whole input image */
+
+  InputAlpha
+  detect_alpha (cv::Mat & input_image)
+  {
+    if (input_alpha != DETECT_ALPHA)
+      return input_alpha;
+
+    render_first = 0;
+    render_last  = input_image.rows;
+
+    return is_opaque (input_image) ? OPAQUE : TRANSLUCENT;
+  }
+
+  /* The type of output_image for an input_image of type input_type. */
+  /* MATCH_INPUT gives CV_8UC4 for CV_8UC4 inputs and CV_64FC4 else.  */
+
+  gint
+  output_type (gint input_type)
+  {
+    switch (output_depth)
+    {
+      case OUTPUT_8U:
+        return CV_8UC4;
+      case OUTPUT_16U:
+        return CV_16UC4;
+      case OUTPUT_64F:
+        return CV_64FC4;
+      default:
+        return input_type == CV_8UC4 ? CV_8UC4 : CV_64FC4;
+    }
+  }
+
+  /* The best instruction set of the cpu, ISA_SSE2 standing for */
+  /* whatever the compiler targets by default off x86           */
+
+  static InstructionSet
+  supported_instruction_set (void)
+  {
+#if VGLIC_X86
+    if (__builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw") &&
+        __builtin_cpu_supports ("avx512vl") && __builtin_cpu_supports ("avx512dq"))
+      return ISA_AVX512;
+
+    if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+      return ISA_AVX2;
+#endif
+
+    return ISA_SSE2;
+  }
+
+  /* The instruction set the hot loops run with: instruction_set, */
+  /* unless it is DETECT_ISA or one the cpu does not have         */
+
+  InstructionSet
+  active_instruction_set (void)
+  {
+    InstructionSet supported = supported_instruction_set ();
+
+    if (instruction_set == DETECT_ISA || instruction_set > supported)
+      return supported;
+
+    return instruction_set;
+  }
+
+  static const char *
+  instruction_set_name (InstructionSet isa)
+  {
+    switch (isa)
+    {
+      case ISA_SSE2:
+        return VGLIC_X86 ? "sse2" : "generic";
+      case ISA_AVX2:
+        return "avx2";
+      case ISA_AVX512:
+        return "avx512";
+      default:
+        return "detect";
+    }
+  }
+
+  void
+  render (cv::Mat & input_image,
+          cv::Mat & output_image,
+          gint first_row,
+          gint last_row)
+  {
+    render (input_image, output_image,
+            cv::Rect (0, first_row, input_image.cols, last_row - first_row));
+  }
+
+  /* Renders the pixels of area only, the others keep whatever */
+  /* output_image had (see VanGoghLICVideo in vglic_video.hpp)  */
+
+  void
+  render (cv::Mat & input_image,
+          cv::Mat & output_image,
+          const cv::Rect & area)
+  {
+    gint first_row = area.y;
+    gint last_row  = area.y + area.height;
+
+    if (input_image.type() != CV_64FC4 && input_image.type() != CV_8UC4)
+      throw std::invalid_argument("VanGoghLIC requires an input_image with type CV_64FC4 or CV_8UC4");
 
-    if (effect_image.type() != CV_64FC4)
-      throw std::invalid_argument("VanGoghLIC requires an effect_image with type CV_64FC4");
+    if (!is_prepared ())
+      throw std::invalid_argument("VanGoghLIC::render requires a call to prepare first");
 
-    output_image = cv::Mat(input_image.rows, input_image.cols, CV_64FC4);
+    if (first_row < 0 || last_row > input_image.rows || first_row >= last_row)
+      throw std::invalid_argument("VanGoghLIC::render requires 0 <= first_row < last_row <= rows");
+
+    if (area.x < 0 || area.x + area.width > input_image.cols || area.width <= 0)
+      throw std::invalid_argument("VanGoghLIC::render requires an area inside input_image");
+
+    /* The integer kernel rounds each pixel to 8 bits as it goes */
+
+    if (arithmetic == FIXED_POINT && quantization == ORDERED_DITHER)
+      throw std::invalid_argument("VanGoghLIC can not dither with arithmetic FIXED_POINT");
 
     if (convolve_with == WHITE_NOISE)
       generatevectors ();
@@ -122,19 +593,208 @@ public:
     maxv   = maximum_value / 10.0;
     isteps = integration_steps;
 
-    effect_width  =  effect_image.cols;
-    effect_height = effect_image.rows;
+    render_first = first_row;
+    render_last  = last_row;
+    render_left  = area.x;
+    render_right = area.x + area.width;
 
-    if (effect_channel == HUE)
-      rgb_to_hsl (effect_image, HUE, scalarfield);
-    else if (effect_channel == SATURATION)
-      rgb_to_hsl (effect_image, SATURATION, scalarfield);
-    else if (effect_channel == BRIGHTNESS)
-      rgb_to_hsl (effect_image, BRIGHTNESS, scalarfield);
-    else
-      throw std::invalid_argument("Invalid value for effect_channel");
+    integration_samples (sample_offsets, sample_weights);
+
+    /* Curved streamlines count their samples as they go */
+
+    rendered_pixels  = (gint64) area.width * area.height;
+    rendered_samples = streamline == CURVED ? 0 : (gint64) sample_offsets.size () * rendered_pixels;
+
+    /* Opaque inputs skip the alpha weighted interpolation entirely */
+
+    gboolean opaque = convolve_with == SOURCE_IMAGE &&
+                      (input_alpha == OPAQUE ||
+                       (input_alpha == DETECT_ALPHA && is_opaque (input_image)));
+
+    if (opaque)
+      opaque_alpha = integration_alpha ();
+
+    /* 8 bit inputs rounded to 8 bit outputs use the integer kernel, */
+    /* which only covers opaque images, as does FIXED_POINT, whose   */
+    /* deeper outputs are its 8 bit results scaled. Anything else    */
+    /* goes through the double precision path                        */
+
+    gint     type     = output_type (input_image.type());
+    gboolean input_8u = input_image.type() == CV_8UC4;
+    gboolean fixed    = opaque && streamline == STRAIGHT && fits_fixed_point () &&
+                        (arithmetic == FIXED_POINT ||
+                         (input_8u && type == CV_8UC4 && quantization == ROUND));
+    gint     first;
+    gint     count;
+
+    source_rows (input_image.rows, first, count);
+
+    create_output (input_image, output_image, type);
+
+    if (fixed)
+    {
+      if (input_8u && type == CV_8UC4)
+      {
+        parallel_rows (first_row, last_row, [&] (gint first, gint last)
+        {
+          dispatch_fixed (input_image, output_image, first, last);
+        });
+        return;
+      }
+
+      cv::Mat output_8u(input_image.rows, input_image.cols, CV_8UC4);
+
+      if (!input_8u)
+        convert_rows (input_image, fixed_image, CV_8UC4, 255.0, first, count);
+
+      cv::Mat & source = input_8u ? input_image : fixed_image;
+
+      parallel_rows (first_row, last_row, [&] (gint first, gint last)
+      {
+        dispatch_fixed (source, output_8u, first, last);
+      });
+
+      cv::Mat area_output = output_image (area);
+
+      output_8u (area).convertTo (area_output, type,
+                                  type == CV_16UC4 ? 257.0 : type == CV_64FC4 ? 1.0 / 255.0 : 1.0);
+      return;
+    }
+
+    /* The floating point kernels read CV_64FC4 */
+
+    cv::Mat input_64f;
+
+    if (input_8u)
+      convert_rows (input_image, input_64f, CV_64FC4, 1.0 / 255.0, first, count);
+
+    cv::Mat & source = input_8u ? input_64f : input_image;
+
+    if (convolve_with == SOURCE_IMAGE && image_layout == PLANAR && streamline == STRAIGHT)
+      to_planar (source, opaque);
+    else if (opaque)
+      to_rgb (source, opaque_image);
 
-    compute_lic (input_image, output_image, scalarfield, effect_operator);
+    /* Everything below is specialized at compile time */
+
+    parallel_rows (first_row, last_row, [&] (gint first, gint last)
+    {
+      if (effect_operator == GRADIENT)
+        dispatch<GRADIENT> (source, output_image, opaque, first, last);
+      else
+        dispatch<DERIVATIVE> (source, output_image, opaque, first, last);
+    });
+  }
+
+  /******************************************************************/
+  /* Renders one output per variant, each the same as a render     */
+  /* with filter_length, integration_steps and effect_operator set  */
+  /* from it. Interleaved floating point renders of CV_64FC4 inputs */
+  /* with SOURCE_IMAGE go through the pixels once: the vector at a  */
+  /* pixel is looked up once for all variants, and a sample offset  */
+  /* used by several variants of the same operator (their grids of  */
+  /* 2 * filter_length / integration_steps steps line up, as with   */
+  /* filter lengths doubling at even integration_steps) is fetched  */
+  /* once, at the offset of one of them: the outputs can differ     */
+  /* from separate renders by rounding. The two operators sample    */
+  /* along perpendicular lines, so they share nothing else. When    */
+  /* less than a quarter of the samples are shared, or with other   */
+  /* settings, the variants are rendered one after the other by the */
+  /* specialized kernels.                                           */
+  /******************************************************************/
+
+  void
+  render (cv::Mat & input_image,
+          const std::vector<RenderVariant> & variants,
+          std::vector<cv::Mat> & output_images,
+          gint first_row,
+          gint last_row)
+  {
+    gdouble        saved_length   = filter_length;
+    gdouble        saved_steps    = integration_steps;
+    EffectOperator saved_operator = effect_operator;
+    SharedSamples  samples[2];
+    size_t         i;
+
+    std::vector<gdouble> alphas;
+
+    output_images.resize (variants.size ());
+
+    gboolean shared = convolve_with == SOURCE_IMAGE && image_layout == INTERLEAVED &&
+                      streamline == STRAIGHT &&
+                      arithmetic == FLOATING_POINT && input_image.type() == CV_64FC4 &&
+                      shared_samples (variants, samples, alphas) * 4 >= samples[0].variant.size () +
+                                                                        samples[1].variant.size ();
+
+    if (!shared)
+    {
+      gint64 total_samples = 0;
+      gint64 total_pixels  = 0;
+
+      for (i = 0; i < variants.size (); i++)
+      {
+        filter_length     = variants[i].filter_length;
+        integration_steps = variants[i].integration_steps;
+        effect_operator   = variants[i].effect_operator;
+
+        render (input_image, output_images[i], first_row, last_row);
+
+        total_samples += rendered_samples;
+        total_pixels  += rendered_pixels;
+      }
+
+      rendered_samples  = total_samples;
+      rendered_pixels   = total_pixels;
+      filter_length     = saved_length;
+      integration_steps = saved_steps;
+      effect_operator   = saved_operator;
+      return;
+    }
+
+    if (!is_prepared ())
+      throw std::invalid_argument("VanGoghLIC::render requires a call to prepare first");
+
+    if (first_row < 0 || last_row > input_image.rows || first_row >= last_row)
+      throw std::invalid_argument("VanGoghLIC::render requires 0 <= first_row < last_row <= rows");
+
+    /* The halo of the longest variant covers the others */
+
+    filter_length = 0.1;
+
+    for (i = 0; i < variants.size (); i++)
+      filter_length = MAX (filter_length, variants[i].filter_length);
+
+    render_first = first_row;
+    render_last  = last_row;
+    render_left  = 0;
+    render_right = input_image.cols;
+
+    /* Each merged offset is fetched once per pixel for all variants */
+
+    rendered_pixels  = (gint64) input_image.cols * (last_row - first_row);
+    rendered_samples = (gint64) (samples[0].offsets.size () + samples[1].offsets.size ()) * rendered_pixels;
+    rendered_pixels *= variants.size ();
+
+    gboolean opaque = input_alpha == OPAQUE ||
+                      (input_alpha == DETECT_ALPHA && is_opaque (input_image));
+
+    for (i = 0; i < variants.size (); i++)
+      create_output (input_image, output_images[i], output_type (input_image.type()));
+
+    if (opaque)
+      to_rgb (input_image, opaque_image);
+
+    parallel_rows (first_row, last_row, [&] (gint first, gint last)
+    {
+      if (opaque)
+        compute_lic_variants<GimpRGB> (opaque_image, output_images, samples, alphas, first, last);
+      else
+        compute_lic_variants<GimpRGBA> (input_image, output_images, samples, alphas, first, last);
+    });
+
+    filter_length     = saved_length;
+    integration_steps = saved_steps;
+    effect_operator   = saved_operator;
   }
 
 private:
@@ -148,8 +808,34 @@ private:
 
   gint effect_width;
   gint effect_height;
+  gint render_first;
+  gint render_last;
+  gint render_left;
+  gint render_right;
+
+  gint64 rendered_samples;
+  gint64 rendered_pixels;
       
   std::vector<uchar> scalarfield;
+  std::vector<gint16> gradientfield;
+  std::shared_ptr<EffectCacheMapping> effect_cache;
+  cv::Mat planes;
+
+  std::vector<gdouble> sample_offsets;
+  std::vector<gdouble> sample_weights;
+
+  /* The white noise vectors, rewritten by every render, so that */
+  /* instances rendering at the same time do not share them      */
+
+  gdouble G[numx][numy][2];
+
+  cv::Mat effect_64f;
+  cv::Mat opaque_image;
+  cv::Mat fixed_image;
+  gdouble opaque_alpha;
+
+  VanGoghLICPool * pool;
+  TaskPriority     pool_priority;
 
 private:
 
@@ -191,6 +877,26 @@ private:
     return (gint) scalarfield[x + effect_width * y];
   }
 
+  /* The prepared fields live in the vectors or in a mapped cache file */
+
+  gboolean
+  is_prepared (void)
+  {
+    return effect_cache || !gradientfield.empty ();
+  }
+
+  const guchar *
+  scalar_data (void)
+  {
+    return effect_cache ? effect_cache->scalarfield : scalarfield.data ();
+  }
+
+  const gint16 *
+  gradient_data (void)
+  {
+    return effect_cache ? effect_cache->gradientfield : gradientfield.data ();
+  }
+
   /*************/
   /* Main part */
   /*************/
@@ -377,35 +1083,42 @@ private:
     return i;
   }
 
+  /* ============================================== */
+  /* Wraps a sample coordinate the way the gimp     */
+  /* plugin did (truncated towards zero, then taken */
+  /* modulo size) and returns its right neighbour.  */
+  /* ============================================== */
+
+  static inline void
+  wrap (gint & i1,
+        gint & i2,
+        gint   size)
+  {
+    if (i1 < 0)
+      i1 = (size - (-i1 % size)) % size;
+    else if (i1 >= size)
+      i1 = i1 % size;
+
+    i2 = i1 + 1;
+
+    if (i2 == size)
+      i2 = 0;
+  }
+
   void
   getpixel (cv::Mat & buffer,
             GimpRGBA & p,
             gdouble u,
             gdouble v)
   {
-    register gint x1, y1, x2, y2;
-    static GimpRGBA pp[4];
-
-    gint width  = buffer.cols;
-    gint height = buffer.rows;
+    gint x1, y1, x2, y2;
+    GimpRGBA pp[4];
 
     x1 = (gint)u;
     y1 = (gint)v;
 
-    if (x1 < 0)
-      x1 = width - (-x1 % width);
-    
-    else
-      x1 = x1 % width;
-
-    if (y1 < 0)
-      y1 = height - (-y1 % height);
-
-    else
-      y1 = y1 % height;
-
-    x2 = (x1 + 1) % width;
-    y2 = (y1 + 1) % height;
+    wrap (x1, x2, buffer.cols);
+    wrap (y1, y2, buffer.rows);
 
     peek (buffer, x1, y1, pp[0]);
     peek (buffer, x2, y1, pp[1]);
@@ -416,54 +1129,620 @@ private:
   }
 
   void
-  lic_image (cv::Mat  & buffer,
-             gint       x,
-             gint       y,
+  getpixel (cv::Mat & buffer,
+            GimpRGB & p,
+            gdouble u,
+            gdouble v)
+  {
+    gint x1, y1, x2, y2;
+    GimpRGB pp[4];
+
+    x1 = (gint)u;
+    y1 = (gint)v;
+
+    wrap (x1, x2, buffer.cols);
+    wrap (y1, y2, buffer.rows);
+
+    pp[0] = buffer.at<GimpRGB>(y1, x1);
+    pp[1] = buffer.at<GimpRGB>(y1, x2);
+    pp[2] = buffer.at<GimpRGB>(y2, x1);
+    pp[3] = buffer.at<GimpRGB>(y2, x2);
+
+    p = gimp_bilinear_rgb (u, v, pp);
+  }
+
+  /* ============================================ */
+  /* Pixel operations shared by both kernel pixel */
+  /* types: GimpRGBA for images with transparency */
+  /* and GimpRGB for fully opaque ones, whose     */
+  /* alpha only depends on the filter and is      */
+  /* computed once (see opaque_alpha).            */
+  /* ============================================ */
+
+  static inline void
+  pixel_multiply (GimpRGBA & p, gdouble factor) { gimp_rgba_multiply (p, factor); }
+
+  static inline void
+  pixel_multiply (GimpRGB & p, gdouble factor) { gimp_rgb_multiply (p, factor); }
+
+  static inline void
+  pixel_add (GimpRGBA & p1, const GimpRGBA & p2) { gimp_rgba_add (p1, p2); }
+
+  static inline void
+  pixel_add (GimpRGB & p1, const GimpRGB & p2) { gimp_rgb_add (p1, p2); }
+
+  inline void
+  pixel_to_rgba (const GimpRGBA & p, GimpRGBA & color) { color = p; }
+
+  inline void
+  pixel_to_rgba (const GimpRGB & p, GimpRGBA & color)
+  {
+    color[0] = p[0];
+    color[1] = p[1];
+    color[2] = p[2];
+    color[3] = opaque_alpha;
+  }
+
+  static inline void
+  pixel_to_rgba (const GimpRGBA & p, gdouble alpha, GimpRGBA & color) { color = p; }
+
+  static inline void
+  pixel_to_rgba (const GimpRGB & p, gdouble alpha, GimpRGBA & color)
+  {
+    color[0] = p[0];
+    color[1] = p[1];
+    color[2] = p[2];
+    color[3] = alpha;
+  }
+
+  /*****************************************************************/
+  /* Integrates the input along the streamline through (x,y), with */
+  /* the offsets and weights prepared by integration_samples. When */
+  /* SAMPLES is not 0 it must match their number, which lets the   */
+  /* compiler unroll the loop.                                     */
+  /*****************************************************************/
+
+  template <typename Pixel, gint SAMPLES>
+  void
+  lic_image (cv::Mat  & buffer,
+             gint       x,
+             gint       y,
              gdouble    vx,
              gdouble    vy,
              GimpRGBA & color)
   {
-    GimpRGBA col1, col2, col3;
-    GimpRGBA col = { 0, 0, 0, 0 };
-    gdouble step = 2.0 * l / isteps;
+    Pixel   col = { 0, };
+    Pixel   sample;
     gdouble xx = (gdouble) x;
     gdouble yy = (gdouble) y;
-    gdouble u;
-    gdouble c;
-    gdouble s;
+    gint    n  = SAMPLES > 0 ? SAMPLES : (gint) sample_offsets.size ();
+    gint    k;
 
-    /* ================= */
-    /* Get vector at x,y */
-    /* ================= */
+    const gdouble * offsets = sample_offsets.data ();
+    const gdouble * weights = sample_weights.data ();
 
-    c = vx;
-    s = vy;
+    for (k = 0; k < n; k++)
+    {
+      getpixel (buffer, sample, xx - offsets[k] * vx, yy - offsets[k] * vy);
+      pixel_multiply (sample, weights[k]);
+      pixel_add (col, sample);
+    }
 
-    /* ============================== */
-    /* Calculate integral numerically */
-    /* ============================== */
+    pixel_to_rgba (col, color);
+    gimp_rgba_clamp (color);
+  }
 
-    getpixel (buffer, col1, xx + l * c, yy + l * s);
-    gimp_rgba_multiply (col1, filter (-l));
-    
-    for (u = -l + step; u <= l; u += step)
+  /* ============================================= */
+  /* The input rows read while rendering the band  */
+  /* render_first to render_last, wrapped around   */
+  /* like the samples: count rows from first on.   */
+  /* ============================================= */
+
+  void
+  source_rows (gint height,
+               gint & first,
+               gint & count)
+  {
+    gint halo = halo_rows ();
+
+    count = MIN (render_last - render_first + 2 * halo, height);
+    first = (count == height) ? 0 : ((render_first - halo) % height + height) % height;
+  }
+
+  void
+  convert_rows (cv::Mat & src,
+                cv::Mat & dst,
+                gint type,
+                gdouble alpha,
+                gint first,
+                gint count)
+  {
+    gint i;
+
+    dst.create (src.rows, src.cols, type);
+
+    for (i = 0; i < count; i++)
+    {
+      cv::Mat row = dst.row ((first + i) % src.rows);
+      src.row ((first + i) % src.rows).convertTo (row, type, alpha);
+    }
+  }
+
+  /* ================================================ */
+  /* Splits first_row to last_row into num_threads    */
+  /* bands of consecutive rows and calls body on each */
+  /* band in its own thread. The kernels only write   */
+  /* the rows they are given, so bands never overlap. */
+  /* Jobs of compute_async hand their rows to the     */
+  /* pool instead.                                    */
+  /* ================================================ */
+
+  template <typename Body>
+  void
+  parallel_rows (gint first_row,
+                 gint last_row,
+                 Body body)
+  {
+    gint threads = CLAMP (num_threads, 1, last_row - first_row);
+    gint i;
+
+    if (pool != nullptr)
+    {
+      pool->parallel_rows (pool_priority, first_row, last_row, POOL_TASK_ROWS, body);
+      return;
+    }
+
+    if (threads == 1)
+    {
+      body (first_row, last_row);
+      return;
+    }
+
+    std::vector<std::thread> workers;
+
+    for (i = 1; i < threads; i++)
+    {
+      gint first = first_row + (gint) ((gint64) (last_row - first_row) * i / threads);
+      gint last  = first_row + (gint) ((gint64) (last_row - first_row) * (i + 1) / threads);
+
+      workers.push_back (std::thread (body, first, last));
+    }
+
+    body (first_row, first_row + (last_row - first_row) / threads);
+
+    for (i = 0; i < (gint) workers.size (); i++)
+      workers[i].join ();
+  }
+
+  /****************************************************************/
+  /* Runs body compiled for isa. The whole call tree of body is   */
+  /* inlined into one copy per instruction set (flatten), built   */
+  /* for the baseline (SSE2 on x86-64), AVX2 and AVX-512 alike,   */
+  /* and the copy is picked at run time from cpuid. Every copy    */
+  /* costs compile time to whoever includes this header, so only  */
+  /* small leaf loops that vectorize go through here (the planar  */
+  /* kernel; the fixed point one has its own intrinsics). AVX2    */
+  /* and AVX-512 fuse multiply-adds, which may change the last    */
+  /* bit of a result.                                             */
+  /****************************************************************/
+
+#if VGLIC_X86
+
+  template <typename Body>
+  __attribute__ ((target ("avx2,fma"), flatten))
+  static void
+  run_avx2 (Body & body)
+  {
+    body ();
+  }
+
+  template <typename Body>
+  __attribute__ ((target ("avx512f,avx512bw,avx512vl,avx512dq"), flatten))
+  static void
+  run_avx512 (Body & body)
+  {
+    body ();
+  }
+
+#endif
+
+  template <typename Body>
+  static void
+  with_instruction_set (InstructionSet isa,
+                        Body body)
+  {
+#if VGLIC_X86
+    if (isa == ISA_AVX512)
+      run_avx512 (body);
+    else if (isa == ISA_AVX2)
+      run_avx2 (body);
+    else
+#endif
+      body ();
+  }
+
+  /* Rows outside the band keep whatever output_image had */
+
+  void
+  create_output (cv::Mat & input_image,
+                 cv::Mat & output_image,
+                 gint type)
+  {
+    if (output_image.data == input_image.data)
+      output_image.release ();
+
+    output_image.create (input_image.rows, input_image.cols, type);
+  }
+
+  /* ================================================= */
+  /* The floating point kernels compute rows of        */
+  /* GimpRGBA, a few at a time (see buffer). CV_64FC4  */
+  /* outputs get them written in place, the others get */
+  /* them in a buffer and store quantizes them while   */
+  /* they are still cached. Only columns first_col to  */
+  /* last_col are stored. Each thread has its own.     */
+  /* ================================================= */
+
+  class RowStore
+  {
+  public:
+
+    RowStore (cv::Mat & output_image,
+              Quantization quantization,
+              gint first_col,
+              gint last_col) :
+      image (output_image),
+      quantization (quantization),
+      first (0),
+      first_col (first_col),
+      last_col (last_col)
+    {
+    }
+
+    void
+    buffer (gint first,
+            gint count)
+    {
+      if (image.type() != CV_64FC4)
+        rows.resize ((size_t) count * image.cols);
+
+      this->first = first;
+    }
+
+    GimpRGBA *
+    row (gint y)
+    {
+      if (image.type() == CV_64FC4)
+        return image.ptr<GimpRGBA> (y);
+
+      return &rows[(size_t) (y - first) * image.cols];
+    }
+
+    void
+    store (gint y)
+    {
+      if (image.type() == CV_8UC4)
+        quantize_row (row (y), image.ptr<guchar> (y), first_col, last_col, y, 255.0, quantization);
+      else if (image.type() == CV_16UC4)
+        quantize_row (row (y), image.ptr<guint16> (y), first_col, last_col, y, 65535.0, quantization);
+    }
+
+  private:
+
+    cv::Mat &             image;
+    Quantization          quantization;
+    std::vector<GimpRGBA> rows;
+    gint                  first;
+    gint                  first_col;
+    gint                  last_col;
+  };
+
+  /* ================================================== */
+  /* The gradient under each pixel of a few rows of the */
+  /* output, as dx, dy pairs indexed by x. With TILE    */
+  /* the effect field repeats (rows narrower than the   */
+  /* output are copied out repeated), with STRETCH it   */
+  /* is scaled to the output: the gradient is           */
+  /* interpolated bilinearly between the centers of the */
+  /* effect pixels and each axis scaled by how much it  */
+  /* is stretched, times up to 32 to keep the fraction. */
+  /* Each thread has its own.                           */
+  /* ================================================== */
+
+  class FieldRows
+  {
+  public:
+
+    FieldRows (VanGoghLIC & lic,
+               gint width,
+               gint height) :
+      lic (lic),
+      width (width),
+      height (height),
+      first (0)
+    {
+      gdouble sx = (gdouble) lic.effect_width / width;
+      gdouble sy = (gdouble) lic.effect_height / height;
+      gint    x;
+
+      stretch  = lic.effect_scaling == STRETCH;
+      scale[0] = 32.0 * sx / MAX (sx, sy);
+      scale[1] = 32.0 * sy / MAX (sx, sy);
+
+      if (!stretch)
+        return;
+
+      x0.resize (width);
+      x1.resize (width);
+      wx.resize (width);
+
+      for (x = 0; x < width; x++)
+      {
+        gdouble fx = CLAMP ((x + 0.5) * sx - 0.5, 0.0, lic.effect_width - 1.0);
+
+        x0[x] = (gint) fx;
+        x1[x] = MIN (x0[x] + 1, lic.effect_width - 1);
+        wx[x] = fx - x0[x];
+      }
+    }
+
+    void
+    buffer (gint first,
+            gint count)
+    {
+      gint i;
+
+      this->first = first;
+
+      if (!stretch && lic.effect_width >= width)
+        return;
+
+      rows.resize ((size_t) count * width * 2);
+
+      for (i = 0; i < count; i++)
+        if (stretch)
+          stretch_row (first + i, &rows[(size_t) i * width * 2]);
+        else
+          tile_row (first + i, &rows[(size_t) i * width * 2]);
+    }
+
+    const gint16 *
+    row (gint y)
     {
-      getpixel (buffer, col2, xx - u * c, yy - u * s);
-      gimp_rgba_multiply (col2, filter (u));
+      if (!stretch && lic.effect_width >= width)
+        return &lic.gradient_data ()[(size_t) (y % lic.effect_height) * lic.effect_width * 2];
 
-      col3 = col1;
+      return &rows[(size_t) (y - first) * width * 2];
+    }
+
+    /* The gradient under any pixel, its coordinates wrapping */
+    /* around the output, as row (y)[x * 2] would give it      */
+
+    void
+    at (gint x,
+        gint y,
+        gint16 * dst)
+    {
+      if (x < 0 || x >= width)
+        x = (x % width + width) % width;
+
+      if (y < 0 || y >= height)
+        y = (y % height + height) % height;
+
+      if (!stretch)
+      {
+        gint ex = x < lic.effect_width ? x : x % lic.effect_width;
+        gint ey = y < lic.effect_height ? y : y % lic.effect_height;
+
+        const gint16 * src = &lic.gradient_data ()[((size_t) ey * lic.effect_width + ex) * 2];
+
+        dst[0] = src[0];
+        dst[1] = src[1];
+        return;
+      }
+
+      gdouble fy = CLAMP ((y + 0.5) * lic.effect_height / height - 0.5, 0.0, lic.effect_height - 1.0);
+      gint    y0 = (gint) fy;
+      gint    y1 = MIN (y0 + 1, lic.effect_height - 1);
+      gdouble wy = fy - y0;
+      gint    c;
+
+      const gint16 * top    = &lic.gradient_data ()[(size_t) y0 * lic.effect_width * 2];
+      const gint16 * bottom = &lic.gradient_data ()[(size_t) y1 * lic.effect_width * 2];
+
+      for (c = 0; c < 2; c++)
+      {
+        gdouble t = top[x0[x] * 2 + c] * (1.0 - wx[x]) + top[x1[x] * 2 + c] * wx[x];
+        gdouble b = bottom[x0[x] * 2 + c] * (1.0 - wx[x]) + bottom[x1[x] * 2 + c] * wx[x];
+
+        dst[c] = (gint16) RINT ((t * (1.0 - wy) + b * wy) * scale[c]);
+      }
+    }
+
+  private:
+
+    VanGoghLIC &        lic;
+    gint                width;
+    gint                height;
+    gint                first;
+    gboolean            stretch;
+    gdouble             scale[2];
+    std::vector<gint>   x0, x1;
+    std::vector<gdouble> wx;
+    std::vector<gint16> rows;
+
+    void
+    tile_row (gint y,
+              gint16 * dst)
+    {
+      const gint16 * src = &lic.gradient_data ()[(size_t) (y % lic.effect_height) * lic.effect_width * 2];
+      gint x, ex;
+
+      for (x = 0, ex = 0; x < width; x++)
+      {
+        dst[x * 2]     = src[ex * 2];
+        dst[x * 2 + 1] = src[ex * 2 + 1];
+
+        if (++ex == lic.effect_width)
+          ex = 0;
+      }
+    }
+
+    void
+    stretch_row (gint y,
+                 gint16 * dst)
+    {
+      gdouble fy = CLAMP ((y + 0.5) * lic.effect_height / height - 0.5, 0.0, lic.effect_height - 1.0);
+      gint    y0 = (gint) fy;
+      gint    y1 = MIN (y0 + 1, lic.effect_height - 1);
+      gdouble wy = fy - y0;
+      gint    x, c;
+
+      const gint16 * top    = &lic.gradient_data ()[(size_t) y0 * lic.effect_width * 2];
+      const gint16 * bottom = &lic.gradient_data ()[(size_t) y1 * lic.effect_width * 2];
+
+      for (x = 0; x < width; x++)
+        for (c = 0; c < 2; c++)
+        {
+          gdouble t = top[x0[x] * 2 + c] * (1.0 - wx[x]) + top[x1[x] * 2 + c] * wx[x];
+          gdouble b = bottom[x0[x] * 2 + c] * (1.0 - wx[x]) + bottom[x1[x] * 2 + c] * wx[x];
+
+          dst[x * 2 + c] = (gint16) RINT ((t * (1.0 - wy) + b * wy) * scale[c]);
+        }
+    }
+  };
+
+  /* Rounds like cv::Mat::convertTo, or adds an 8x8 Bayer threshold */
+  /* to the colors. Alpha is always rounded.                         */
+
+  template <typename T>
+  static void
+  quantize_row (const GimpRGBA * src,
+                T * dst,
+                gint first,
+                gint last,
+                gint y,
+                gdouble scale,
+                Quantization quantization)
+  {
+    static const guchar bayer[8][8] =
+    {
+      {  0, 32,  8, 40,  2, 34, 10, 42 },
+      { 48, 16, 56, 24, 50, 18, 58, 26 },
+      { 12, 44,  4, 36, 14, 46,  6, 38 },
+      { 60, 28, 52, 20, 62, 30, 54, 22 },
+      {  3, 35, 11, 43,  1, 33,  9, 41 },
+      { 51, 19, 59, 27, 49, 17, 57, 25 },
+      { 15, 47,  7, 39, 13, 45,  5, 37 },
+      { 63, 31, 55, 23, 61, 29, 53, 21 }
+    };
+
+    gint x;
+    gint c;
+
+    if (quantization == ORDERED_DITHER)
+    {
+      const guchar * threshold = bayer[y & 7];
+
+      for (x = first; x < last; x++)
+      {
+        gdouble t = (threshold[x & 7] + 0.5) / 64.0;
+
+        for (c = 0; c < 3; c++)
+          dst[x * 4 + c] = (T) floor (src[x][c] * scale + t);
+
+        dst[x * 4 + 3] = (T) RINT (src[x][3] * scale);
+      }
+    }
+    else
+    {
+      for (x = first; x < last; x++)
+        for (c = 0; c < 4; c++)
+          dst[x * 4 + c] = (T) RINT (src[x][c] * scale);
+    }
+  }
+
+  gboolean
+  is_opaque (cv::Mat & input_image)
+  {
+    gint x;
+    gint y;
+    gint i;
+    gint first;
+    gint count;
+
+    source_rows (input_image.rows, first, count);
+
+    for (i = 0; i < count; i++)
+    {
+      y = (first + i) % input_image.rows;
+
+      if (input_image.type() == CV_8UC4)
+      {
+        const guchar * row = input_image.ptr<guchar> (y);
+
+        for (x = 0; x < input_image.cols; x++)
+          if (row[x * 4 + 3] != 255)
+            return false;
+      }
+      else
+      {
+        const GimpRGBA * row = input_image.ptr<GimpRGBA> (y);
+
+        for (x = 0; x < input_image.cols; x++)
+          if (row[x][3] != 1.0)
+            return false;
+      }
+    }
+
+    return true;
+  }
+
+  void
+  to_rgb (cv::Mat & input_image,
+          cv::Mat & rgb_image)
+  {
+    gint x;
+    gint y;
+    gint i;
+    gint first;
+    gint count;
 
-      gimp_rgba_add (col3, col2);
-      gimp_rgba_multiply (col3, 0.5 * step);
-      gimp_rgba_add (col, col3);
+    rgb_image.create (input_image.rows, input_image.cols, CV_64FC3);
+    source_rows (input_image.rows, first, count);
 
-      col1 = col2;
+    for (i = 0; i < count; i++)
+    {
+      y = (first + i) % input_image.rows;
+
+      const GimpRGBA * src = input_image.ptr<GimpRGBA> (y);
+      GimpRGB * dst = rgb_image.ptr<GimpRGB> (y);
+
+      for (x = 0; x < input_image.cols; x++)
+      {
+        dst[x][0] = src[x][0];
+        dst[x][1] = src[x][1];
+        dst[x][2] = src[x][2];
+      }
     }
-  
-    gimp_rgba_multiply (col, 1.0 / l);
-    gimp_rgba_clamp (col);
+  }
+
+  /* Alpha of the integral over a fully opaque image. The */
+  /* weights of a curved streamline always add up to 1.   */
+
+  gdouble
+  integration_alpha (void)
+  {
+    gdouble alpha = 0.0;
+    size_t  k;
+
+    if (streamline == CURVED)
+      return 1.0;
+
+    for (k = 0; k < sample_weights.size (); k++)
+      alpha += sample_weights[k];
 
-    color = col;
+    return CLAMP (alpha, 0.0, 1.0);
   }
 
   void
@@ -478,7 +1757,7 @@ private:
     gdouble   val = 0.0;
     glong     index = 0;
 
-    std::mt19937 generator;
+    std::mt19937 generator (dither_seed);
     std::uniform_real_distribution<double> uniform1;
 
     themap.resize(effect_image.cols * effect_image.rows);
@@ -500,63 +1779,1229 @@ private:
       }
   }
 
+  /*****************************************************/
+  /* The derivative of the scalar field at every pixel */
+  /* of the effect. Kernels read the vector at (x,y)   */
+  /* from here and rotate/normalize it with get_vector */
+  /*****************************************************/
+
   void
-  compute_lic (cv::Mat & input_image,
-               cv::Mat & output_image,
-               const std::vector<guchar> & scalarfield,
-               EffectOperator effect_operator)
+  compute_gradientfield (const std::vector<guchar> & scalarfield,
+                         std::vector<gint16> & gradientfield)
+  {
+    gint   x;
+    gint   y;
+    size_t index = 0;
+
+    gradientfield.resize ((size_t) effect_width * effect_height * 2);
+
+    for (y = 0; y < effect_height; y++)
+      for (x = 0; x < effect_width; x++)
+      {
+        gradientfield[index++] = (gint16) gradx (scalarfield, x, y);
+        gradientfield[index++] = (gint16) grady (scalarfield, x, y);
+      }
+  }
+
+  template <EffectOperator OPERATOR>
+  static inline void
+  get_vector (const gint16 * gradient,
+              gdouble & vx,
+              gdouble & vy)
+  {
+    gdouble tmp;
+
+    vx = gradient[0];
+    vy = gradient[1];
+
+    /* Rotate if needed */
+    if (OPERATOR == GRADIENT)
+    {
+      tmp = vy;
+      vy = -vx;
+      vx = tmp;
+    }
+
+    tmp = sqrt (vx * vx + vy * vy);
+
+    if (tmp >= 0.000001)
+    {
+      tmp = 1.0 / tmp;
+      vx *= tmp;
+      vy *= tmp;
+    }
+  }
+
+  template <EffectOperator OPERATOR, ConvolveWith CONVOLVE, typename Pixel, gint SAMPLES>
+  inline void
+  lic_pixel (cv::Mat  & input_image,
+             const gint16 * gradient,
+             gint       x,
+             gint       y,
+             GimpRGBA & color)
   {
-    gint xcount;
-    gint ycount;
-    GimpRGBA color;
     gdouble vx;
     gdouble vy;
     gdouble tmp;
 
-    for (ycount = 0; ycount < input_image.rows; ycount++)
-      for (xcount = 0; xcount < input_image.cols; xcount++)
-      {
-        /* ======================================== */
-        /* Get derivative at (x,y) and normalize it */
-        /* ======================================== */
+    /* ======================================== */
+    /* Get derivative at (x,y) and normalize it */
+    /* ======================================== */
 
-        vx = gradx (scalarfield, xcount, ycount);
-        vy = grady (scalarfield, xcount, ycount);
+    get_vector<OPERATOR> (gradient, vx, vy);
 
-        /* Rotate if needed */
-        if (effect_operator == GRADIENT)
-        {
-          tmp = vy;
-          vy = -vx;
-          vx = tmp;
-        }
+    /* ============================== */
+    /* Convolve with the LIC at (x,y) */
+    /* ============================== */
+
+    if (CONVOLVE == WHITE_NOISE)
+    {
+      peek (input_image, x, y, color);
+      tmp = lic_noise (x, y, vx, vy);
+      gimp_rgba_multiply (color, tmp);
+    }
+    else
+    {
+      lic_image<Pixel, SAMPLES> (input_image, x, y, vx, vy, color);
+    }
+  }
 
-        tmp = sqrt (vx * vx + vy * vy);
+  template <EffectOperator OPERATOR, ConvolveWith CONVOLVE, typename Pixel, gint SAMPLES>
+  void
+  compute_lic (cv::Mat & input_image,
+               cv::Mat & output_image,
+               gint first_row,
+               gint last_row)
+  {
+    RowStore  store (output_image, quantization, render_left, render_right);
+    FieldRows field_rows (*this, output_image.cols, output_image.rows);
+    gint      xcount;
+    gint      ycount;
 
-        if (tmp >= 0.000001)
-        {
-          tmp = 1.0 / tmp;
-          vx *= tmp;
-          vy *= tmp;
-        }
+    /* White noise only reads the pixel itself, any order will do */
 
-        /* ============================== */
-        /* Convolve with the LIC at (x,y) */
-        /* ============================== */
+    if (traversal != ROW_MAJOR && CONVOLVE == SOURCE_IMAGE)
+    {
+      compute_lic_blocked<OPERATOR, CONVOLVE, Pixel, SAMPLES> (input_image, output_image,
+                                                               first_row, last_row);
+      return;
+    }
 
-        if (convolve_with == WHITE_NOISE)
-        {
-          peek (input_image, xcount, ycount, color);
-          tmp = lic_noise (xcount, ycount, vx, vy);
-          gimp_rgba_multiply (color, tmp);
-        }
-        else if (convolve_with == SOURCE_IMAGE)
-        {
-          lic_image (input_image, xcount, ycount, vx, vy, color);
-        }
+    for (ycount = first_row; ycount < last_row; ycount++)
+    {
+      field_rows.buffer (ycount, 1);
+      store.buffer (ycount, 1);
 
-        poke (output_image, xcount, ycount, color);
-      }
+      const gint16 * field = field_rows.row (ycount);
+      GimpRGBA     * out   = store.row (ycount);
+
+      for (xcount = render_left; xcount < render_right; xcount++)
+        lic_pixel<OPERATOR, CONVOLVE, Pixel, SAMPLES> (input_image, &field[xcount * 2],
+                                                       xcount, ycount, out[xcount]);
+
+      store.store (ycount);
+    }
+  }
+
+  /* ================================================================ */
+  /* Blocked traversal. The band is split into square tiles whose     */
+  /* input footprint (the tile and the filter_length halo around it)  */
+  /* fits in half of the L2 cache, so the rows a streamline reaches   */
+  /* above and below are still cached for the next pixels. Inside a   */
+  /* tile, pixels are visited row by row (BLOCKED) or in Z-order.     */
+  /* ================================================================ */
+
+  static glong
+  l2_cache_size (void)
+  {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    glong size = sysconf (_SC_LEVEL2_CACHE_SIZE);
+
+    if (size > 0)
+      return size;
+#endif
+
+    return 256 * 1024;
+  }
+
+  gint
+  block_side (size_t pixel_size)
+  {
+    if (block_size > 0)
+      return block_size;
+
+    gint side = (gint) sqrt ((gdouble) l2_cache_size () / 2 / pixel_size) - 2 * halo_rows ();
+
+    return MAX (side, 16);
+  }
+
+  /* Every other bit of v, packed (x of a Morton code) */
+
+  static inline gint
+  compact_bits (guint64 v)
+  {
+    v &= 0x5555555555555555ULL;
+    v = (v | (v >> 1))  & 0x3333333333333333ULL;
+    v = (v | (v >> 2))  & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | (v >> 4))  & 0x00ff00ff00ff00ffULL;
+    v = (v | (v >> 8))  & 0x0000ffff0000ffffULL;
+    v = (v | (v >> 16)) & 0x00000000ffffffffULL;
+
+    return (gint) v;
+  }
+
+  template <EffectOperator OPERATOR, ConvolveWith CONVOLVE, typename Pixel, gint SAMPLES>
+  void
+  compute_lic_blocked (cv::Mat & input_image,
+                       cv::Mat & output_image,
+                       gint first_row,
+                       gint last_row)
+  {
+    RowStore  store (output_image, quantization, render_left, render_right);
+    FieldRows field_rows (*this, output_image.cols, output_image.rows);
+
+    gint    tile = block_side (sizeof (Pixel));
+    guint64 side, m;
+    gint    x0, y0, x1, y1, x, y, w, h, s;
+
+    /* No tile is larger than the area */
+
+    tile = MIN (tile, MAX (last_row - first_row, render_right - render_left));
+
+    for (y0 = first_row; y0 < last_row; y0 += tile)
+    {
+      y1 = MIN (y0 + tile, last_row);
+
+      field_rows.buffer (y0, y1 - y0);
+      store.buffer (y0, y1 - y0);
+
+      for (x0 = render_left; x0 < render_right; x0 += tile)
+      {
+        x1 = MIN (x0 + tile, render_right);
+
+        if (traversal == Z_ORDER)
+        {
+          /* Tiles cut short by the edges of the area are visited */
+          /* as squares of their short side, one after the other  */
+
+          w = x1 - x0;
+          h = y1 - y0;
+
+          side = 1;
+
+          while (side < (guint64) MIN (w, h))
+            side <<= 1;
+
+          for (s = 0; s < MAX (w, h); s += side)
+            for (m = 0; m < side * side; m++)
+            {
+              x = x0 + compact_bits (m);
+              y = y0 + compact_bits (m >> 1);
+
+              if (w >= h)
+                x += s;
+              else
+                y += s;
+
+              if (x < x1 && y < y1)
+                lic_pixel<OPERATOR, CONVOLVE, Pixel, SAMPLES> (input_image,
+                    &field_rows.row (y)[x * 2], x, y, store.row (y)[x]);
+            }
+        }
+        else
+        {
+          for (y = y0; y < y1; y++)
+          {
+            const gint16 * field = field_rows.row (y);
+            GimpRGBA     * out   = store.row (y);
+
+            for (x = x0; x < x1; x++)
+              lic_pixel<OPERATOR, CONVOLVE, Pixel, SAMPLES> (input_image, &field[x * 2],
+                                                             x, y, out[x]);
+          }
+        }
+      }
+
+      for (y = y0; y < y1; y++)
+        store.store (y);
+    }
+  }
+
+  /*******************************************************************/
+  /* CURVED streamlines. Instead of the line along the vector at     */
+  /* (x,y), the samples follow the field itself: the streamline is   */
+  /* integrated both ways from (x,y) with RK4 over the vectors       */
+  /* interpolated between pixels, up to filter_length pixels of arc. */
+  /* Each step is compared with the midpoint (RK2) step built from   */
+  /* its first two stages. When they end more than                   */
+  /* streamline_tolerance pixels apart the step is retried shorter,  */
+  /* down to STREAMLINE_MIN_STEP, and while they agree the next one  */
+  /* grows, up to STREAMLINE_MAX_STEP. Straight flow thus takes a    */
+  /* few long steps and bends as many short ones as they need. The   */
+  /* input is sampled at the end of every step, the triangle filter  */
+  /* integrated over the arc with the trapezoidal rule. A streamline */
+  /* running into a vanishing vector keeps its last point for the    */
+  /* rest of its length.                                             */
+  /*******************************************************************/
+
+  /* The unit vector of the field at (px,py), interpolated between */
+  /* the four pixels around it, times direction. FALSE where the   */
+  /* field vanishes.                                               */
+
+  template <EffectOperator OPERATOR>
+  static inline gboolean
+  field_vector (FieldRows & field_rows,
+                gdouble px,
+                gdouble py,
+                gdouble direction,
+                gdouble & vx,
+                gdouble & vy)
+  {
+    gint    ix = (gint) floor (px);
+    gint    iy = (gint) floor (py);
+    gdouble fx = px - ix;
+    gdouble fy = py - iy;
+    gint16  g[4][2];
+    gdouble gradient[2];
+    gdouble norm;
+    gint    c;
+
+    field_rows.at (ix,     iy,     g[0]);
+    field_rows.at (ix + 1, iy,     g[1]);
+    field_rows.at (ix,     iy + 1, g[2]);
+    field_rows.at (ix + 1, iy + 1, g[3]);
+
+    for (c = 0; c < 2; c++)
+      gradient[c] = (g[0][c] * (1.0 - fx) + g[1][c] * fx) * (1.0 - fy) +
+                    (g[2][c] * (1.0 - fx) + g[3][c] * fx) * fy;
+
+    /* Rotated as get_vector does */
+
+    if (OPERATOR == GRADIENT)
+    {
+      vx = gradient[1];
+      vy = -gradient[0];
+    }
+    else
+    {
+      vx = gradient[0];
+      vy = gradient[1];
+    }
+
+    norm = sqrt (vx * vx + vy * vy);
+
+    if (norm < 0.000001)
+      return false;
+
+    norm = direction / norm;
+    vx *= norm;
+    vy *= norm;
+
+    return true;
+  }
+
+  /* One RK4 step of h pixels from (px,py), where the vector is k1. */
+  /* error is how far from its end the midpoint step ends.          */
+
+  template <EffectOperator OPERATOR>
+  static inline gboolean
+  streamline_step (FieldRows & field_rows,
+                   gdouble px,
+                   gdouble py,
+                   gdouble k1x,
+                   gdouble k1y,
+                   gdouble direction,
+                   gdouble h,
+                   gdouble & nx,
+                   gdouble & ny,
+                   gdouble & error)
+  {
+    gdouble k2x, k2y, k3x, k3y, k4x, k4y;
+
+    if (!field_vector<OPERATOR> (field_rows, px + 0.5 * h * k1x, py + 0.5 * h * k1y,
+                                 direction, k2x, k2y) ||
+        !field_vector<OPERATOR> (field_rows, px + 0.5 * h * k2x, py + 0.5 * h * k2y,
+                                 direction, k3x, k3y) ||
+        !field_vector<OPERATOR> (field_rows, px + h * k3x, py + h * k3y,
+                                 direction, k4x, k4y))
+      return false;
+
+    nx = px + h / 6.0 * (k1x + 2.0 * (k2x + k3x) + k4x);
+    ny = py + h / 6.0 * (k1y + 2.0 * (k2y + k3y) + k4y);
+
+    error = sqrt ((nx - px - h * k2x) * (nx - px - h * k2x) +
+                  (ny - py - h * k2y) * (ny - py - h * k2y));
+
+    return true;
+  }
+
+  /* Follows the streamline from (x,y) along direction (1 or -1) and */
+  /* calls sample (px, py, weight) on its points past (x,y). Returns */
+  /* the weight of (x,y) itself in this half of the streamline.      */
+
+  template <EffectOperator OPERATOR, typename Sampler>
+  gdouble
+  trace_streamline (FieldRows & field_rows,
+                    gint x,
+                    gint y,
+                    gdouble direction,
+                    Sampler & sample)
+  {
+    gdouble tolerance  = MAX (streamline_tolerance, 0.001);
+    gdouble px         = x;
+    gdouble py         = y;
+    gdouble s          = 0.0;
+    gdouble previous   = 0.0;
+    gdouble first_step = 0.0;
+    gdouble h          = MIN (STREAMLINE_MAX_STEP, l);
+    gdouble k1x, k1y, nx, ny, error, factor;
+
+    if (!field_vector<OPERATOR> (field_rows, px, py, direction, k1x, k1y))
+      return 0.5;
+
+    while (l - s > 1e-9)
+    {
+      h = MIN (h, l - s);
+
+      /* A stage reached a vanishing vector: shorter, or stop here */
+
+      if (!streamline_step<OPERATOR> (field_rows, px, py, k1x, k1y, direction, h, nx, ny, error))
+      {
+        if (h <= STREAMLINE_MIN_STEP)
+          break;
+
+        h = MAX (h * 0.5, STREAMLINE_MIN_STEP);
+        continue;
+      }
+
+      /* The midpoint step is second order: its error goes with h^3 */
+
+      factor = error > 0.0 ? 0.9 * cbrt (tolerance / error) : 4.0;
+
+      if (error > tolerance && h > STREAMLINE_MIN_STEP)
+      {
+        h = MAX (h * MAX (factor, 0.2), STREAMLINE_MIN_STEP);
+        continue;
+      }
+
+      if (s == 0.0)
+        first_step = h;
+      else
+        sample (px, py, filter (s) * (s + h - previous) * 0.5 / l);
+
+      previous = s;
+      s       += h;
+      px       = nx;
+      py       = ny;
+      h        = CLAMP (h * MIN (factor, 4.0), STREAMLINE_MIN_STEP, STREAMLINE_MAX_STEP);
+
+      if (l - s > 1e-9 && !field_vector<OPERATOR> (field_rows, px, py, direction, k1x, k1y))
+        break;
+    }
+
+    if (s == 0.0)
+      return 0.5;
+
+    /* The rest of the filter, if any, goes to the last point */
+
+    if (l - s > 1e-9)
+      sample (px, py, filter (s) * (s - previous) * 0.5 / l + (l - s) * (l - s) * 0.5 / (l * l));
+
+    return first_step * 0.5 / l;
+  }
+
+  template <EffectOperator OPERATOR, ConvolveWith CONVOLVE, typename Pixel>
+  void
+  compute_lic_curved (cv::Mat & input_image,
+                      cv::Mat & output_image,
+                      gint first_row,
+                      gint last_row)
+  {
+    RowStore  store (output_image, quantization, render_left, render_right);
+    FieldRows field_rows (*this, output_image.cols, output_image.rows);
+    gint64    samples = 0;
+    gdouble   center;
+    gint      x, y;
+
+    for (y = first_row; y < last_row; y++)
+    {
+      store.buffer (y, 1);
+
+      GimpRGBA * out = store.row (y);
+
+      for (x = render_left; x < render_right; x++)
+      {
+        if (CONVOLVE == WHITE_NOISE)
+        {
+          gdouble i = 0.0;
+
+          auto add = [&] (gdouble px, gdouble py, gdouble weight)
+          {
+            i += weight * noise (px, py);
+            samples++;
+          };
+
+          center = trace_streamline<OPERATOR> (field_rows, x, y, 1.0, add) +
+                   trace_streamline<OPERATOR> (field_rows, x, y, -1.0, add);
+          add (x, y, center);
+
+          /* Scaled as lic_noise, whose weights are not divided by l */
+
+          i = (i * l - minv) / (maxv - minv);
+          i = CLAMP (i, 0.0, 1.0);
+          i = (i / 2.0) + 0.5;
+
+          peek (input_image, x, y, out[x]);
+          gimp_rgba_multiply (out[x], i);
+        }
+        else
+        {
+          Pixel col = { 0, };
+          Pixel sample;
+
+          auto add = [&] (gdouble px, gdouble py, gdouble weight)
+          {
+            getpixel (input_image, sample, px, py);
+            pixel_multiply (sample, weight);
+            pixel_add (col, sample);
+            samples++;
+          };
+
+          center = trace_streamline<OPERATOR> (field_rows, x, y, 1.0, add) +
+                   trace_streamline<OPERATOR> (field_rows, x, y, -1.0, add);
+          add (x, y, center);
+
+          pixel_to_rgba (col, out[x]);
+          gimp_rgba_clamp (out[x]);
+        }
+      }
+
+      store.store (y);
+    }
+
+    /* Bands run in parallel */
+
+    __atomic_fetch_add (&rendered_samples, samples, __ATOMIC_RELAXED);
+  }
+
+  template <EffectOperator OPERATOR>
+  void
+  dispatch (cv::Mat & input_image,
+            cv::Mat & output_image,
+            gboolean opaque,
+            gint first_row,
+            gint last_row)
+  {
+    gint width  = input_image.cols;
+    gint height = input_image.rows;
+
+    if (streamline == CURVED)
+    {
+      if (convolve_with == WHITE_NOISE)
+        compute_lic_curved<OPERATOR, WHITE_NOISE, GimpRGBA> (input_image, output_image, first_row, last_row);
+      else if (opaque)
+        compute_lic_curved<OPERATOR, SOURCE_IMAGE, GimpRGB> (opaque_image, output_image, first_row, last_row);
+      else
+        compute_lic_curved<OPERATOR, SOURCE_IMAGE, GimpRGBA> (input_image, output_image, first_row, last_row);
+    }
+    else if (convolve_with == WHITE_NOISE)
+    {
+      compute_lic<OPERATOR, WHITE_NOISE, GimpRGBA, 0> (input_image, output_image, first_row, last_row);
+    }
+    else if (image_layout == PLANAR)
+    {
+      if (opaque)
+        compute_lic_planar<OPERATOR, true> (width, height, output_image, first_row, last_row);
+      else
+        compute_lic_planar<OPERATOR, false> (width, height, output_image, first_row, last_row);
+    }
+    else if (opaque)
+    {
+      compute_lic_image<OPERATOR, GimpRGB> (opaque_image, output_image, first_row, last_row);
+    }
+    else
+    {
+      compute_lic_image<OPERATOR, GimpRGBA> (input_image, output_image, first_row, last_row);
+    }
+  }
+
+  /* =========================================== */
+  /* Picks an unrolled kernel for the usual      */
+  /* integration_steps (4, 10, 20, 25 and 50),   */
+  /* which leave one less sample of weight > 0   */
+  /* =========================================== */
+
+  template <EffectOperator OPERATOR, typename Pixel>
+  void
+  compute_lic_image (cv::Mat & input_image,
+                     cv::Mat & output_image,
+                     gint first_row,
+                     gint last_row)
+  {
+    switch (sample_offsets.size ())
+    {
+      case 3:
+        compute_lic<OPERATOR, SOURCE_IMAGE, Pixel, 3> (input_image, output_image, first_row, last_row);
+        break;
+      case 9:
+        compute_lic<OPERATOR, SOURCE_IMAGE, Pixel, 9> (input_image, output_image, first_row, last_row);
+        break;
+      case 19:
+        compute_lic<OPERATOR, SOURCE_IMAGE, Pixel, 19> (input_image, output_image, first_row, last_row);
+        break;
+      case 24:
+        compute_lic<OPERATOR, SOURCE_IMAGE, Pixel, 24> (input_image, output_image, first_row, last_row);
+        break;
+      case 49:
+        compute_lic<OPERATOR, SOURCE_IMAGE, Pixel, 49> (input_image, output_image, first_row, last_row);
+        break;
+      default:
+        compute_lic<OPERATOR, SOURCE_IMAGE, Pixel, 0> (input_image, output_image, first_row, last_row);
+        break;
+    }
+  }
+
+  /******************************************************/
+  /* Integer variant for 8 bit opaque images. Each      */
+  /* sample adds its four texels with the product of    */
+  /* their bilinear weight and the filter weight in Q15 */
+  /* (see vglic_fixed.hpp), which keeps the result      */
+  /* within 1 LSB of the double precision path.         */
+  /******************************************************/
+
+  /* Every tap weight must fit in a signed 16 bit integer */
+
+  gboolean
+  fits_fixed_point (void)
+  {
+    size_t k;
+
+    for (k = 0; k < sample_weights.size (); k++)
+      if (sample_weights[k] * FIXED_POINT_ONE >= FIXED_POINT_ONE - 0.5)
+        return false;
+
+    return true;
+  }
+
+  /* Border pixels, whose streamline may wrap around the image */
+
+  template <typename Taps>
+  inline void
+  lic_fixed (cv::Mat & input_image,
+             gint      x,
+             gint      y,
+             gdouble   vx,
+             gdouble   vy,
+             guchar  * out)
+  {
+    typename Taps::Acc acc;
+
+    gint n = (gint) sample_offsets.size ();
+    gint k;
+
+    const gdouble * offsets = sample_offsets.data ();
+    const gdouble * weights = sample_weights.data ();
+
+    Taps::zero (acc);
+
+    for (k = 0; k < n; k++)
+    {
+      gdouble su = x - offsets[k] * vx;
+      gdouble sv = y - offsets[k] * vy;
+      gint    x1 = (gint) su;
+      gint    y1 = (gint) sv;
+      gint    x2, y2;
+      gdouble fx = su - (gdouble) x1;
+      gdouble fy = sv - (gdouble) y1;
+
+      if (fx < 0)
+        fx += 1.0;
+      if (fy < 0)
+        fy += 1.0;
+
+      wrap (x1, x2, input_image.cols);
+      wrap (y1, y2, input_image.rows);
+
+      gdouble wt = weights[k] * FIXED_POINT_ONE * (1.0 - fy);
+      gdouble wb = weights[k] * FIXED_POINT_ONE * fy;
+
+      Taps::add (acc,
+                 input_image.ptr<guint32> (y1),
+                 input_image.ptr<guint32> (y2),
+                 x1, x2,
+                 (gint16) (wt * (1.0 - fx) + 0.5),
+                 (gint16) (wt * fx + 0.5),
+                 (gint16) (wb * (1.0 - fx) + 0.5),
+                 (gint16) (wb * fx + 0.5));
+    }
+
+    Taps::store (acc, out);
+  }
+
+  /* ============================================================== */
+  /* Pixels at least margin away from the borders never wrap. For   */
+  /* them each sample is done in two passes over the row: one that  */
+  /* computes texel indices and packed weight pairs, which the      */
+  /* compiler vectorizes, and one that accumulates the texels.      */
+  /* ============================================================== */
+
+  template <EffectOperator OPERATOR, typename Taps>
+  void
+  compute_lic_fixed (cv::Mat & input_image,
+                     cv::Mat & output_image,
+                     gint first_row,
+                     gint last_row)
+  {
+    gint    width  = input_image.cols;
+    gint    height = input_image.rows;
+    gint    margin = (gint) ceil (l) + 1;
+    gint    left   = render_left;
+    gint    right  = render_right;
+    gint    first  = MAX (margin, left);
+    gint    last   = MAX (MIN (width - margin - 1, right), first);
+    gint    n      = (gint) sample_offsets.size ();
+    gint    x, y, k;
+    guchar  alpha  = (guchar) RINT (opaque_alpha * 255.0);
+
+    FieldRows field_rows (*this, width, height);
+
+    const guchar * data   = input_image.ptr<guchar> (0);
+    gint           stride = (gint) (input_image.step / 4);
+
+    std::vector<gdouble> vx (width), vy (width);
+    std::vector<gint32>  index (width), wtop (width), wbot (width);
+    std::vector<gint32>  acc (width * 4);
+
+    for (y = first_row; y < last_row; y++)
+    {
+      field_rows.buffer (y, 1);
+
+      const gint16 * field = field_rows.row (y);
+      guchar * out = output_image.ptr<guchar> (y);
+      gboolean inner_row = y >= margin && y < height - margin - 1 && first < last;
+
+      for (x = left; x < right; x++)
+        get_vector<OPERATOR> (&field[x * 2], vx[x], vy[x]);
+
+      for (x = left; x < right; x++)
+      {
+        if (inner_row && x == first)
+          x = last;
+
+        if (x == right)
+          break;
+
+        lic_fixed<Taps> (input_image, x, y, vx[x], vy[x], &out[x * 4]);
+        out[x * 4 + 3] = alpha;
+      }
+
+      if (!inner_row)
+        continue;
+
+      std::fill (acc.begin (), acc.end (), 0);
+
+      for (k = 0; k < n; k++)
+      {
+        gdouble u = sample_offsets[k];
+        gdouble w = sample_weights[k] * FIXED_POINT_ONE;
+
+        for (x = first; x < last; x++)
+        {
+          gdouble su = x - u * vx[x];
+          gdouble sv = y - u * vy[x];
+          gint    x1 = (gint) su;
+          gint    y1 = (gint) sv;
+          gdouble fx = su - (gdouble) x1;
+          gdouble fy = sv - (gdouble) y1;
+          gdouble wt = w * (1.0 - fy);
+          gdouble wb = w * fy;
+
+          index[x] = y1 * stride + x1;
+          wtop[x]  = (gint32) (wt * (1.0 - fx) + 0.5) | ((gint32) (wt * fx + 0.5) << 16);
+          wbot[x]  = (gint32) (wb * (1.0 - fx) + 0.5) | ((gint32) (wb * fx + 0.5) << 16);
+        }
+
+        Taps::add_span (&acc[first * 4], data, stride,
+                        &index[first], &wtop[first], &wbot[first], last - first);
+      }
+
+      for (x = first; x < last; x++)
+      {
+        for (gint c = 0; c < 3; c++)
+        {
+          gint32 v = (acc[x * 4 + c] + (FIXED_POINT_ONE >> 1)) >> FIXED_POINT_SHIFT;
+          out[x * 4 + c] = (guchar) (v > 255 ? 255 : v);
+        }
+
+        out[x * 4 + 3] = alpha;
+      }
+    }
+  }
+
+#if VGLIC_X86
+
+  template <EffectOperator OPERATOR>
+  __attribute__ ((target ("sse4.1"), flatten))
+  void
+  compute_lic_fixed_sse41 (cv::Mat & input_image,
+                           cv::Mat & output_image,
+                           gint first_row,
+                           gint last_row)
+  {
+    compute_lic_fixed<OPERATOR, FixedTapsSse41> (input_image, output_image, first_row, last_row);
+  }
+
+  template <EffectOperator OPERATOR>
+  __attribute__ ((target ("avx2"), flatten))
+  void
+  compute_lic_fixed_avx2 (cv::Mat & input_image,
+                          cv::Mat & output_image,
+                          gint first_row,
+                          gint last_row)
+  {
+    compute_lic_fixed<OPERATOR, FixedTapsAvx2> (input_image, output_image, first_row, last_row);
+  }
+
+#endif
+
+  template <EffectOperator OPERATOR>
+  void
+  dispatch_fixed (cv::Mat & input_image,
+                  cv::Mat & output_image,
+                  gint first_row,
+                  gint last_row)
+  {
+#if VGLIC_X86
+    InstructionSet isa = active_instruction_set ();
+
+    if (isa >= ISA_AVX2)
+      compute_lic_fixed_avx2<OPERATOR> (input_image, output_image, first_row, last_row);
+    else if (instruction_set == DETECT_ISA && __builtin_cpu_supports ("sse4.1"))
+      compute_lic_fixed_sse41<OPERATOR> (input_image, output_image, first_row, last_row);
+    else
+#endif
+      compute_lic_fixed<OPERATOR, FixedTapsScalar> (input_image, output_image, first_row, last_row);
+  }
+
+  void
+  dispatch_fixed (cv::Mat & input_image,
+                  cv::Mat & output_image,
+                  gint first_row,
+                  gint last_row)
+  {
+    if (effect_operator == GRADIENT)
+      dispatch_fixed<GRADIENT> (input_image, output_image, first_row, last_row);
+    else
+      dispatch_fixed<DERIVATIVE> (input_image, output_image, first_row, last_row);
+  }
+
+  /******************************************************/
+  /* Planar variant of the integration. The input image */
+  /* is converted once into four premultiplied float    */
+  /* planes, and each integration step is evaluated for */
+  /* a whole row at a time, one channel per inner loop. */
+  /* Opaque images only get the three color planes.     */
+  /* Only the rows the band reads are written, and the  */
+  /* planes are not cleared, so that the other rows do  */
+  /* not take any memory in a shard worker.             */
+  /******************************************************/
+
+  void
+  to_planar (cv::Mat & input_image,
+             gboolean opaque)
+  {
+    gint   x;
+    gint   y;
+    gint   i;
+    gint   first;
+    gint   count;
+    size_t index;
+    size_t plane_size = (size_t) input_image.cols * input_image.rows;
+
+    planes.create (input_image.rows * (opaque ? 3 : 4), input_image.cols, CV_32FC1);
+
+    gfloat * r = planes.ptr<gfloat> ();
+    gfloat * g = r + plane_size;
+    gfloat * b = g + plane_size;
+    gfloat * a = b + plane_size;
+
+    source_rows (input_image.rows, first, count);
+
+    for (i = 0; i < count; i++)
+    {
+      y     = (first + i) % input_image.rows;
+      index = (size_t) y * input_image.cols;
+
+      const GimpRGBA * row = input_image.ptr<GimpRGBA> (y);
+
+      if (opaque)
+      {
+        for (x = 0; x < input_image.cols; x++, index++)
+        {
+          r[index] = (gfloat) row[x][0];
+          g[index] = (gfloat) row[x][1];
+          b[index] = (gfloat) row[x][2];
+        }
+
+        continue;
+      }
+
+      for (x = 0; x < input_image.cols; x++, index++)
+      {
+        a[index] = (gfloat) row[x][3];
+        r[index] = (gfloat) (row[x][0] * row[x][3]);
+        g[index] = (gfloat) (row[x][1] * row[x][3]);
+        b[index] = (gfloat) (row[x][2] * row[x][3]);
+      }
+    }
+  }
+
+  /* ======================================================= */
+  /* Expands the trapezoidal rule used by lic_image into a   */
+  /* list of offsets along the streamline and their weights, */
+  /* already divided by l. Samples where the triangle filter */
+  /* vanishes (its two ends) are dropped.                    */
+  /* ======================================================= */
+
+  void
+  integration_samples (std::vector<gdouble> & offsets,
+                       std::vector<gdouble> & weights)
+  {
+    std::vector<gdouble> u_list;
+    gdouble step = 2.0 * l / isteps;
+    gdouble u;
+    gdouble f;
+    gdouble w;
+    size_t  k;
+
+    offsets.clear ();
+    weights.clear ();
+
+    u_list.push_back (-l);
+
+    for (u = -l + step; u <= l; u += step)
+      u_list.push_back (u);
+
+    if (u_list.size () < 2)
+      return;
+
+    for (k = 0; k < u_list.size (); k++)
+    {
+      f = filter (u_list[k]);
+
+      if (f < 1e-9)
+        continue;
+
+      w = 0.5 * step * f;
+
+      if (k != 0 && k + 1 != u_list.size ())
+        w *= 2.0;
+
+      offsets.push_back (u_list[k]);
+      weights.push_back (w / l);
+    }
+  }
+
+  /* ================================================= */
+  /* The samples of the variants of one operator, with */
+  /* the offsets they have in common merged: offset j  */
+  /* is weighted into variant[t] by weight[t], for t   */
+  /* from first[j] to first[j + 1]. Offsets ascend, as */
+  /* they do for each variant, so every variant still  */
+  /* adds up its samples in the order lic_image does.  */
+  /* Offsets within SHARED_OFFSET_TOLERANCE of the     */
+  /* first of a group count as the same: the u that    */
+  /* lic_image accumulates from -l drifts in the last  */
+  /* bits, differently for each length. The middle     */
+  /* samples, about 0, are only merged when equal:     */
+  /* they land on the pixel itself, and getpixel can   */
+  /* jump between a coordinate exactly on a pixel and  */
+  /* one a rounding off it (it truncates towards 0,    */
+  /* and a neighbour of zero alpha only drops out of   */
+  /* the bilinear exactly on the pixel).               */
+  /* ================================================= */
+
+  typedef struct
+  {
+    std::vector<gdouble> offsets;
+    std::vector<size_t>  first;
+    std::vector<gint>    variant;
+    std::vector<gdouble> weight;
+  } SharedSamples;
+
+  /* Returns how many samples are fetched once instead of twice or more */
+
+  size_t
+  shared_samples (const std::vector<RenderVariant> & variants,
+                  SharedSamples * samples,
+                  std::vector<gdouble> & alphas)
+  {
+    std::vector<std::pair<gdouble, std::pair<gint, gdouble> > > taps[2];
+    std::vector<gdouble> offsets;
+    std::vector<gdouble> weights;
+    size_t saved = 0;
+    size_t i;
+    size_t k;
+    gint   op;
+
+    alphas.resize (variants.size ());
+
+    for (i = 0; i < variants.size (); i++)
+    {
+      l      = MAX (variants[i].filter_length, 0.1);
+      isteps = variants[i].integration_steps;
+
+      integration_samples (offsets, weights);
+
+      alphas[i] = 0.0;
+
+      for (k = 0; k < offsets.size (); k++)
+      {
+        taps[variants[i].effect_operator].push_back (
+          std::make_pair (offsets[k], std::make_pair ((gint) i, weights[k])));
+        alphas[i] += weights[k];
+      }
+
+      alphas[i] = CLAMP (alphas[i], 0.0, 1.0);
+    }
+
+    for (op = 0; op < 2; op++)
+    {
+      SharedSamples & s = samples[op];
+
+      std::stable_sort (taps[op].begin (), taps[op].end (),
+                        [] (const std::pair<gdouble, std::pair<gint, gdouble> > & a,
+                            const std::pair<gdouble, std::pair<gint, gdouble> > & b)
+                        { return a.first < b.first; });
+
+      for (k = 0; k < taps[op].size (); k++)
+      {
+        gdouble offset = taps[op][k].first;
+
+        if (s.offsets.empty () ||
+            (offset != s.offsets.back () &&
+             (offset - s.offsets.back () > SHARED_OFFSET_TOLERANCE ||
+              fabs (offset) <= SHARED_OFFSET_TOLERANCE ||
+              fabs (s.offsets.back ()) <= SHARED_OFFSET_TOLERANCE)))
+        {
+          s.offsets.push_back (offset);
+          s.first.push_back (k);
+        }
+
+        s.variant.push_back (taps[op][k].second.first);
+        s.weight.push_back (taps[op][k].second.second);
+      }
+
+      s.first.push_back (taps[op].size ());
+
+      saved += taps[op].size () - s.offsets.size ();
+    }
+
+    return saved;
+  }
+
+  template <typename Pixel>
+  void
+  compute_lic_variants (cv::Mat & input_image,
+                        std::vector<cv::Mat> & output_images,
+                        const SharedSamples * samples,
+                        const std::vector<gdouble> & alphas,
+                        gint first_row,
+                        gint last_row)
+  {
+    std::vector<RowStore> stores;
+    std::vector<Pixel>    cols (output_images.size ());
+    Pixel                 sample;
+    Pixel                 weighted;
+    GimpRGBA              color;
+    gdouble               vx, vy;
+    gint                  x, y, op;
+    size_t                i, j, t;
+
+    FieldRows field_rows (*this, input_image.cols, input_image.rows);
+
+    for (i = 0; i < output_images.size (); i++)
+      stores.push_back (RowStore (output_images[i], quantization, 0, output_images[i].cols));
+
+    for (y = first_row; y < last_row; y++)
+    {
+      field_rows.buffer (y, 1);
+
+      const gint16 * field = field_rows.row (y);
+
+      for (i = 0; i < stores.size (); i++)
+        stores[i].buffer (y, 1);
+
+      for (x = 0; x < input_image.cols; x++)
+      {
+        for (i = 0; i < cols.size (); i++)
+          cols[i] = Pixel ();
+
+        for (op = 0; op < 2; op++)
+        {
+          const SharedSamples & s = samples[op];
+
+          if (s.offsets.empty ())
+            continue;
+
+          if (op == GRADIENT)
+            get_vector<GRADIENT> (&field[x * 2], vx, vy);
+          else
+            get_vector<DERIVATIVE> (&field[x * 2], vx, vy);
+
+          for (j = 0; j < s.offsets.size (); j++)
+          {
+            getpixel (input_image, sample, x - s.offsets[j] * vx, y - s.offsets[j] * vy);
+
+            for (t = s.first[j]; t < s.first[j + 1]; t++)
+            {
+              weighted = sample;
+              pixel_multiply (weighted, s.weight[t]);
+              pixel_add (cols[s.variant[t]], weighted);
+            }
+          }
+        }
+
+        for (i = 0; i < cols.size (); i++)
+        {
+          pixel_to_rgba (cols[i], alphas[i], color);
+          gimp_rgba_clamp (color);
+          stores[i].row (y)[x] = color;
+        }
+      }
+
+      for (i = 0; i < stores.size (); i++)
+        stores[i].store (y);
+    }
+  }
+
+  template <EffectOperator OPERATOR, bool OPAQUE>
+  void
+  compute_lic_planar (gint width,
+                      gint height,
+                      cv::Mat & output_image,
+                      gint first_row,
+                      gint last_row)
+  {
+    RowStore  store (output_image, quantization, render_left, render_right);
+    FieldRows field_rows (*this, width, height);
+
+    const std::vector<gdouble> & offsets = sample_offsets;
+    const std::vector<gdouble> & weights = sample_weights;
+
+    std::vector<gdouble> vx (width), vy (width);
+    std::vector<gint>    i00 (width), i01 (width), i10 (width), i11 (width);
+    std::vector<gfloat>  w00 (width), w01 (width), w10 (width), w11 (width);
+    std::vector<gfloat>  scale (width);
+    std::vector<gfloat>  acc (width * 4);
+
+    size_t         plane_size = (size_t) width * height;
+    InstructionSet isa        = active_instruction_set ();
+    gint           x, y, c;
+    size_t         k;
+
+    for (y = first_row; y < last_row; y++)
+    {
+      field_rows.buffer (y, 1);
+
+      const gint16 * field = field_rows.row (y);
+
+      for (x = render_left; x < render_right; x++)
+        get_vector<OPERATOR> (&field[x * 2], vx[x], vy[x]);
+
+      std::fill (acc.begin (), acc.end (), 0.0f);
+
+      /* The only loops built for each instruction set: they are */
+      /* short, and the only ones the compiler vectorizes much    */
+
+      with_instruction_set (isa, [&] ()
+      {
+        for (k = 0; k < offsets.size (); k++)
+        {
+          gdouble u = offsets[k];
+          gfloat  w = (gfloat) weights[k];
+
+          /* Sample coordinates and bilinear weights for the whole row, */
+          /* using the same wrapping rules as getpixel                   */
+
+          for (x = render_left; x < render_right; x++)
+          {
+            gdouble su = x - u * vx[x];
+            gdouble sv = y - u * vy[x];
+            gint    x1 = (gint) su;
+            gint    y1 = (gint) sv;
+            gdouble fx = su - (gdouble) x1;
+            gdouble fy = sv - (gdouble) y1;
+
+            if (fx < 0)
+              fx += 1.0;
+            if (fy < 0)
+              fy += 1.0;
+
+            gint x2, y2;
+
+            wrap (x1, x2, width);
+            wrap (y1, y2, height);
+
+            i00[x] = x1 + y1 * width;
+            i01[x] = x2 + y1 * width;
+            i10[x] = x1 + y2 * width;
+            i11[x] = x2 + y2 * width;
+
+            w00[x] = (gfloat) ((1.0 - fx) * (1.0 - fy));
+            w01[x] = (gfloat) (fx * (1.0 - fy));
+            w10[x] = (gfloat) ((1.0 - fx) * fy);
+            w11[x] = (gfloat) (fx * fy);
+          }
+
+          /* Alpha first, it scales the premultiplied colors back */
+
+          if (OPAQUE)
+          {
+            std::fill (scale.begin (), scale.end (), w);
+          }
+          else
+          {
+            const gfloat * pa = planes.ptr<gfloat> () + plane_size * 3;
+            gfloat * acc_a = &acc[width * 3];
+
+            for (x = render_left; x < render_right; x++)
+            {
+              gfloat alpha = w00[x] * pa[i00[x]] + w01[x] * pa[i01[x]] +
+                             w10[x] * pa[i10[x]] + w11[x] * pa[i11[x]];
+
+              acc_a[x] += w * alpha;
+              scale[x]  = (alpha > 0.0f) ? w / alpha : 0.0f;
+            }
+          }
+
+          for (c = 0; c < 3; c++)
+          {
+            const gfloat * p = planes.ptr<gfloat> () + plane_size * c;
+            gfloat * acc_c = &acc[width * c];
+
+            for (x = render_left; x < render_right; x++)
+              acc_c[x] += scale[x] * (w00[x] * p[i00[x]] + w01[x] * p[i01[x]] +
+                                      w10[x] * p[i10[x]] + w11[x] * p[i11[x]]);
+          }
+        }
+      });
+
+      store.buffer (y, 1);
+
+      GimpRGBA * out = store.row (y);
+
+      for (x = render_left; x < render_right; x++)
+      {
+        out[x][0] = acc[x];
+        out[x][1] = acc[x + width];
+        out[x][2] = acc[x + width * 2];
+        out[x][3] = OPAQUE ? opaque_alpha : acc[x + width * 3];
+        gimp_rgba_clamp (out[x]);
+      }
+
+      store.store (y);
+    }
   }
 
 };
@@ -0,0 +1,422 @@
+/* Line Integral Convolution (LIC) - autotuning
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Times VanGoghLIC on random images to pick the image_layout, traversal,
+ * block_size and num_threads that run fastest on this machine, and keeps
+ * the winners in a profile file, one line per cpu model, filter_length
+ * and image size:
+ *
+ *   cpu model \t filter_length \t width \t height \t image_layout \t
+ *   traversal \t block_size \t num_threads \t Mpixel/s
+ *
+ * Only settings that leave the result unchanged are tuned, so arithmetic
+ * is never switched to FIXED_POINT and image_layout stays INTERLEAVED:
+ * the float planes of PLANAR round a few 8 bit pixels differently.
+ */
+
+#ifndef VAN_GOGH_LIC_AUTOTUNE_HPP
+#define VAN_GOGH_LIC_AUTOTUNE_HPP
+
+#include "vglic.hpp"
+
+#include <cfloat>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+typedef struct
+{
+  std::string cpu_model;
+  gdouble     filter_length;
+  gint        width;
+  gint        height;
+  ImageLayout image_layout;
+  Traversal   traversal;
+  gint        block_size;
+  gint        num_threads;
+  gdouble     mpixels_per_second;
+} AutotuneProfile;
+
+static const char * const autotune_layout_names[]    = { "INTERLEAVED", "PLANAR" };
+static const char * const autotune_traversal_names[] = { "ROW_MAJOR", "BLOCKED", "Z_ORDER" };
+
+/* The "model name" of the first cpu in /proc/cpuinfo */
+
+static inline std::string
+autotune_cpu_model (void)
+{
+  std::ifstream cpuinfo ("/proc/cpuinfo");
+  std::string   line;
+
+  while (std::getline (cpuinfo, line))
+  {
+    size_t colon = line.find (':');
+
+    if (line.compare (0, 10, "model name") != 0 || colon == std::string::npos)
+      continue;
+
+    std::string model = line.substr (line.find_first_not_of (" \t", colon + 1));
+
+    for (size_t i = 0; i < model.size (); i++)
+      if (model[i] == '\t')
+        model[i] = ' ';
+
+    return model;
+  }
+
+  return "unknown";
+}
+
+/* $XDG_CACHE_HOME/vglic/autotune.tsv, or ~/.cache/vglic/autotune.tsv */
+
+static inline std::string
+autotune_default_path (void)
+{
+  const char * cache = getenv ("XDG_CACHE_HOME");
+  const char * home  = getenv ("HOME");
+
+  if (cache != NULL && cache[0] != '\0')
+    return std::string (cache) + "/vglic/autotune.tsv";
+
+  if (home != NULL && home[0] != '\0')
+    return std::string (home) + "/.cache/vglic/autotune.tsv";
+
+  return "";
+}
+
+static inline void
+autotune_apply (const AutotuneProfile & profile,
+                VanGoghLIC & lic)
+{
+  lic.image_layout = profile.image_layout;
+  lic.traversal    = profile.traversal;
+  lic.block_size   = profile.block_size;
+  lic.num_threads  = profile.num_threads;
+}
+
+static inline gboolean
+autotune_parse_name (const std::string & name,
+                     const char * const * names,
+                     gint count,
+                     gint & value)
+{
+  for (value = 0; value < count; value++)
+    if (name == names[value])
+      return true;
+
+  return false;
+}
+
+/* Every line of the profile file, skipping those it can not read */
+
+static inline std::vector<AutotuneProfile>
+autotune_read_profiles (const std::string & path)
+{
+  std::vector<AutotuneProfile> profiles;
+  std::ifstream file (path.c_str ());
+  std::string   line;
+
+  while (std::getline (file, line))
+  {
+    std::istringstream fields (line);
+    std::string        layout, traversal;
+    AutotuneProfile    profile;
+    gint               index;
+
+    if (line.empty () || line[0] == '#' ||
+        !std::getline (fields, profile.cpu_model, '\t'))
+      continue;
+
+    if (!(fields >> profile.filter_length >> profile.width >> profile.height
+                 >> layout >> traversal >> profile.block_size
+                 >> profile.num_threads >> profile.mpixels_per_second))
+      continue;
+
+    /* Older profiles could pick PLANAR, which changes the result */
+
+    if (!autotune_parse_name (layout, autotune_layout_names, 2, index) ||
+        index != INTERLEAVED)
+      continue;
+    profile.image_layout = (ImageLayout) index;
+
+    if (!autotune_parse_name (traversal, autotune_traversal_names, 3, index))
+      continue;
+    profile.traversal = (Traversal) index;
+
+    profiles.push_back (profile);
+  }
+
+  return profiles;
+}
+
+/* Adds profile to the file at path (autotune_default_path () if empty), */
+/* replacing the line of the same cpu model, filter_length and size      */
+
+static inline gboolean
+autotune_save_profile (const AutotuneProfile & profile,
+                       std::string path = "")
+{
+  if (path.empty ())
+    path = autotune_default_path ();
+
+  if (path.empty ())
+    return false;
+
+  std::vector<AutotuneProfile> profiles = autotune_read_profiles (path);
+  std::string tmp_path = path + ".tmp";
+  size_t      i;
+
+  /* Create the missing directories */
+
+  for (i = path.find ('/', 1); i != std::string::npos; i = path.find ('/', i + 1))
+    mkdir (path.substr (0, i).c_str (), 0755);
+
+  std::ofstream file (tmp_path.c_str ());
+
+  file << "# cpu model\tfilter_length\twidth\theight\timage_layout\t"
+          "traversal\tblock_size\tnum_threads\tMpixel/s\n";
+
+  /* The new line goes last, older ones with the same key are dropped */
+
+  profiles.push_back (profile);
+
+  for (i = 0; i < profiles.size (); i++)
+  {
+    const AutotuneProfile & p = profiles[i];
+
+    if (i + 1 < profiles.size () && p.cpu_model == profile.cpu_model &&
+        p.filter_length == profile.filter_length &&
+        p.width == profile.width && p.height == profile.height)
+      continue;
+
+    file << p.cpu_model << '\t' << p.filter_length << '\t' << p.width << '\t'
+         << p.height << '\t' << autotune_layout_names[p.image_layout] << '\t'
+         << autotune_traversal_names[p.traversal] << '\t' << p.block_size << '\t'
+         << p.num_threads << '\t' << p.mpixels_per_second << '\n';
+  }
+
+  file.close ();
+
+  if (!file || rename (tmp_path.c_str (), path.c_str ()) != 0)
+  {
+    remove (tmp_path.c_str ());
+    return false;
+  }
+
+  return true;
+}
+
+/* Applies the profile of this cpu model closest to lic.filter_length  */
+/* and width x height (both compared as ratios) to lic. Returns false, */
+/* leaving lic alone, when the file has none.                          */
+
+static inline gboolean
+autotune_load_profile (VanGoghLIC & lic,
+                       gint width,
+                       gint height,
+                       std::string path = "")
+{
+  if (path.empty ())
+    path = autotune_default_path ();
+
+  std::vector<AutotuneProfile> profiles = autotune_read_profiles (path);
+  std::string cpu_model = autotune_cpu_model ();
+  gdouble     best_distance = DBL_MAX;
+  gint        best = -1;
+  gint        i;
+
+  for (i = 0; i < (gint) profiles.size (); i++)
+  {
+    const AutotuneProfile & p = profiles[i];
+
+    if (p.cpu_model != cpu_model || p.filter_length <= 0 || p.width <= 0 || p.height <= 0)
+      continue;
+
+    gdouble distance = fabs (log (p.filter_length / MAX (lic.filter_length, 0.1))) +
+                       fabs (log ((gdouble) p.width * p.height / MAX ((gdouble) width * height, 1.0)));
+
+    if (distance < best_distance)
+    {
+      best_distance = distance;
+      best          = i;
+    }
+  }
+
+  if (best < 0)
+    return false;
+
+  autotune_apply (profiles[best], lic);
+
+  return true;
+}
+
+/* Mpixel/s of the fastest of runs renders of input_image */
+
+static inline gdouble
+autotune_measure (VanGoghLIC & lic,
+                  cv::Mat & input_image,
+                  cv::Mat & output_image,
+                  gint runs)
+{
+  gdouble best = DBL_MAX;
+  gint    i;
+
+  for (i = 0; i < runs; i++)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+
+    lic.render (input_image, output_image, 0, input_image.rows);
+
+    std::chrono::duration<gdouble> elapsed = std::chrono::steady_clock::now () - start;
+
+    best = MIN (best, elapsed.count ());
+  }
+
+  return input_image.total () / MAX (best, 1e-9) / 1e6;
+}
+
+/* ============================================================ */
+/* Times the kernel variants with one thread, then the fastest  */
+/* one with 2, 4, ... up to every hardware thread, on a random  */
+/* width x height image with the other settings of lic. The     */
+/* winner is applied to lic and returned, ready to be saved.    */
+/* ============================================================ */
+
+static inline AutotuneProfile
+autotune (VanGoghLIC & lic,
+          gint width = 512,
+          gint height = 512,
+          gint runs = 2)
+{
+  static const struct
+  {
+    ImageLayout image_layout;
+    Traversal   traversal;
+    gint        block_size;
+  } variants[] =
+  {
+    { INTERLEAVED, ROW_MAJOR, 0   },
+    { INTERLEAVED, BLOCKED,   0   },
+    { INTERLEAVED, BLOCKED,   32  },
+    { INTERLEAVED, BLOCKED,   64  },
+    { INTERLEAVED, BLOCKED,   128 },
+    { INTERLEAVED, Z_ORDER,   0   }
+  };
+
+  VanGoghLIC      bench = lic;
+  AutotuneProfile profile;
+  std::mt19937    random (width * 31 + height);
+  cv::Mat         input_image (height, width, CV_64FC4);
+  cv::Mat         effect_image (height, width, CV_64FC4);
+  cv::Mat         output_image;
+  gint            x, y, c, i;
+
+  std::uniform_real_distribution<gdouble> uniform (0.0, 1.0);
+
+  for (y = 0; y < height; y++)
+  {
+    GimpRGBA * in     = input_image.ptr<GimpRGBA> (y);
+    GimpRGBA * effect = effect_image.ptr<GimpRGBA> (y);
+
+    for (x = 0; x < width; x++)
+    {
+      for (c = 0; c < 3; c++)
+      {
+        in[x][c]     = uniform (random);
+        effect[x][c] = uniform (random);
+      }
+
+      in[x][3]     = lic.input_alpha == TRANSLUCENT ? uniform (random) : 1.0;
+      effect[x][3] = 1.0;
+    }
+  }
+
+  /* The shell reads 8 bit inputs for the fixed point kernel */
+
+  if (lic.arithmetic == FIXED_POINT)
+  {
+    cv::Mat input_8u;
+
+    input_image.convertTo (input_8u, CV_8UC4, 255.0);
+    input_image = input_8u;
+  }
+
+  bench.prepare (effect_image);
+  bench.num_threads = 1;
+
+  profile.cpu_model          = autotune_cpu_model ();
+  profile.filter_length      = lic.filter_length;
+  profile.width              = width;
+  profile.height             = height;
+  profile.mpixels_per_second = 0;
+
+  /* warm up */
+
+  bench.render (input_image, output_image, 0, height);
+
+  for (i = 0; i < (gint) (sizeof (variants) / sizeof (variants[0])); i++)
+  {
+    bench.image_layout = variants[i].image_layout;
+    bench.traversal    = variants[i].traversal;
+    bench.block_size   = variants[i].block_size;
+
+    gdouble speed = autotune_measure (bench, input_image, output_image, runs);
+
+    if (speed > profile.mpixels_per_second)
+    {
+      profile.image_layout       = bench.image_layout;
+      profile.traversal          = bench.traversal;
+      profile.block_size         = bench.block_size;
+      profile.num_threads        = 1;
+      profile.mpixels_per_second = speed;
+    }
+  }
+
+  bench.image_layout = profile.image_layout;
+  bench.traversal    = profile.traversal;
+  bench.block_size   = profile.block_size;
+
+  std::vector<gint> thread_counts;
+  gint              hardware_threads = (gint) std::thread::hardware_concurrency ();
+
+  for (i = 2; i < hardware_threads; i *= 2)
+    thread_counts.push_back (i);
+
+  if (hardware_threads > 1)
+    thread_counts.push_back (hardware_threads);
+
+  for (i = 0; i < (gint) thread_counts.size (); i++)
+  {
+    bench.num_threads = thread_counts[i];
+
+    gdouble speed = autotune_measure (bench, input_image, output_image, runs);
+
+    if (speed > profile.mpixels_per_second)
+    {
+      profile.num_threads        = thread_counts[i];
+      profile.mpixels_per_second = speed;
+    }
+  }
+
+  autotune_apply (profile, lic);
+
+  return profile;
+}
+
+#endif /* VAN_GOGH_LIC_AUTOTUNE_HPP */
@@ -0,0 +1,235 @@
+/* Line Integral Convolution (LIC) - effect cache files
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Everything VanGoghLIC derives from an effect image, stored so that it
+ * can be memory mapped and used in place:
+ *
+ *   EffectCacheHeader                   (64 bytes)
+ *   scalar field, width * height bytes  (padded to 64 bytes)
+ *   gradient field, width * height * 2 int16 (dx, dy)
+ *
+ * The gradient is stored before it is rotated and normalized, which
+ * get_vector does when reading it, so one file serves both operators.
+ * Numbers are in the native byte order; a file written on a machine
+ * with a different one fails the magic check.
+ */
+
+#ifndef VAN_GOGH_LIC_CACHE_HPP
+#define VAN_GOGH_LIC_CACHE_HPP
+
+#include "libgimpcolor.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EFFECT_CACHE_MAGIC   0x00584643494c4756ULL   /* "VGLICFX" */
+#define EFFECT_CACHE_VERSION 2
+
+typedef struct
+{
+  guint64 magic;
+  guint32 version;
+  guint32 header_size;
+  gint32  width;
+  gint32  height;
+  gint32  effect_channel;
+  guint32 dither_seed;
+  guint64 source_size;       /* of the effect image file, 0 if unknown */
+  guint64 source_hash;       /* of its contents, see effect_cache_hash */
+  guint64 reserved[2];
+} EffectCacheHeader;
+
+static inline size_t
+effect_cache_scalar_size (gint width,
+                          gint height)
+{
+  return ((size_t) width * height + 63) & ~(size_t) 63;
+}
+
+static inline size_t
+effect_cache_size (gint width,
+                   gint height)
+{
+  return sizeof (EffectCacheHeader) + effect_cache_scalar_size (width, height) +
+         (size_t) width * height * 2 * sizeof (gint16);
+}
+
+/* A read only mapping of a cache file, unmapped on destruction */
+
+class EffectCacheMapping
+{
+public:
+
+  const EffectCacheHeader * header;
+  const guchar            * scalarfield;
+  const gint16            * gradientfield;
+
+  EffectCacheMapping (void * data,
+                      size_t size)
+  {
+    this->data = data;
+    this->size = size;
+
+    header        = (const EffectCacheHeader *) data;
+    scalarfield   = (const guchar *) data + sizeof (EffectCacheHeader);
+    gradientfield = (const gint16 *) (scalarfield +
+                    effect_cache_scalar_size (header->width, header->height));
+  }
+
+  ~EffectCacheMapping ()
+  {
+    munmap (data, size);
+  }
+
+private:
+
+  void * data;
+  size_t size;
+
+  EffectCacheMapping (const EffectCacheMapping &);
+  EffectCacheMapping & operator= (const EffectCacheMapping &);
+};
+
+/* A hash of the contents of the file at path, to tell whether the */
+/* effect image changed since its cache was written. Timestamps can */
+/* stay the same across a change; the contents cannot. Reading the  */
+/* file is much cheaper than decoding it. FNV-1a over 64 bit words, */
+/* then over the bytes left. Returns 0 when path cannot be read.    */
+
+static inline guint64
+effect_cache_hash (const char * path)
+{
+  const guint64 prime = 0x100000001b3ULL;
+  guint64 hash = 0xcbf29ce484222325ULL;
+  guint64 words[8192];
+  ssize_t count;
+  gint fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    return 0;
+
+  while ((count = read (fd, words, sizeof (words))) > 0)
+  {
+    size_t i;
+    size_t full = (size_t) count / sizeof (guint64);
+
+    for (i = 0; i < full; i++)
+      hash = (hash ^ words[i]) * prime;
+
+    for (i = full * sizeof (guint64); i < (size_t) count; i++)
+      hash = (hash ^ ((const guchar *) words)[i]) * prime;
+  }
+
+  close (fd);
+
+  return count < 0 ? 0 : hash;
+}
+
+/* Maps path and checks that it is a complete cache file. Returns NULL */
+/* when the file is missing, truncated, or from another version        */
+
+static inline EffectCacheMapping *
+effect_cache_map (const char * path)
+{
+  struct stat st;
+  void * data;
+  gint fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) != 0 || (size_t) st.st_size < sizeof (EffectCacheHeader))
+  {
+    close (fd);
+    return NULL;
+  }
+
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (data == MAP_FAILED)
+    return NULL;
+
+  const EffectCacheHeader * header = (const EffectCacheHeader *) data;
+
+  if (header->magic != EFFECT_CACHE_MAGIC ||
+      header->version != EFFECT_CACHE_VERSION ||
+      header->header_size != sizeof (EffectCacheHeader) ||
+      header->width <= 0 || header->height <= 0 ||
+      (size_t) st.st_size != effect_cache_size (header->width, header->height))
+  {
+    munmap (data, st.st_size);
+    return NULL;
+  }
+
+  return new EffectCacheMapping (data, st.st_size);
+}
+
+/* Writes a new file next to path and renames it over path, so that */
+/* concurrent readers never map a partial file. The new file gets a  */
+/* unique name, so that concurrent writers do not write into each    */
+/* other's file either                                               */
+
+static inline gboolean
+effect_cache_write (const char              * path,
+                    const EffectCacheHeader & header,
+                    const guchar            * scalarfield,
+                    const gint16            * gradientfield)
+{
+  std::string tmp_path = std::string (path) + ".XXXXXX";
+  size_t scalar_size   = (size_t) header.width * header.height;
+  size_t padding       = effect_cache_scalar_size (header.width, header.height) - scalar_size;
+  static const guchar zeros[64] = { 0, };
+
+  /* mkstemp creates the file readable by its owner only */
+
+  gint fd = mkstemp (&tmp_path[0]);
+
+  if (fd < 0)
+    return false;
+
+  FILE * file = fchmod (fd, 0644) == 0 ? fdopen (fd, "wb") : NULL;
+
+  if (file == NULL)
+  {
+    close (fd);
+    remove (tmp_path.c_str ());
+    return false;
+  }
+
+  gboolean ok = fwrite (&header, sizeof (header), 1, file) == 1 &&
+                fwrite (scalarfield, 1, scalar_size, file) == scalar_size &&
+                fwrite (zeros, 1, padding, file) == padding &&
+                fwrite (gradientfield, sizeof (gint16), scalar_size * 2, file) == scalar_size * 2;
+
+  ok = (fclose (file) == 0) && ok;
+
+  if (ok)
+    ok = rename (tmp_path.c_str (), path) == 0;
+
+  if (!ok)
+    remove (tmp_path.c_str ());
+
+  return ok;
+}
+
+#endif /* VAN_GOGH_LIC_CACHE_HPP */
@@ -0,0 +1,314 @@
+/* Line Integral Convolution (LIC) - fixed point taps
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Accumulators used by the 8 bit integer LIC kernel. Every integration
+ * sample contributes the four texels around it, each one weighted by the
+ * product of its bilinear weight and the triangle filter weight of the
+ * sample, in Q15 fixed point. Texels are packed BGRA bytes, the running
+ * sums are 32 bit integers.
+ *
+ * add() accumulates one sample of one pixel. add_span() accumulates one
+ * sample for a run of pixels whose texels do not wrap around the image:
+ * index[i] is the top left texel (in pixels from data), and wtop[i] and
+ * wbot[i] hold the left/right weights of the top/bottom texel rows
+ * packed as two int16 (left in the low half).
+ *
+ * The SIMD variants are compiled with target attributes, so the binary
+ * does not need -msse4.1/-mavx2. VanGoghLIC checks the cpu at runtime
+ * before using them.
+ */
+
+#ifndef VAN_GOGH_LIC_FIXED_HPP
+#define VAN_GOGH_LIC_FIXED_HPP
+
+#include "libgimpcolor.hpp"
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define VGLIC_X86 1
+#include <immintrin.h>
+#else
+#define VGLIC_X86 0
+#endif
+
+#define FIXED_POINT_SHIFT 15
+#define FIXED_POINT_ONE   (1 << FIXED_POINT_SHIFT)
+
+
+/**********/
+/* Scalar */
+/**********/
+
+struct FixedTapsScalar
+{
+  struct Acc
+  {
+    gint32 v[4];
+  };
+
+  static inline void
+  zero (Acc & acc)
+  {
+    acc.v[0] = acc.v[1] = acc.v[2] = acc.v[3] = 0;
+  }
+
+  static inline void
+  add (Acc            & acc,
+       const guint32  * row1,
+       const guint32  * row2,
+       gint             x1,
+       gint             x2,
+       gint16           w00,
+       gint16           w01,
+       gint16           w10,
+       gint16           w11)
+  {
+    const guchar * p00 = (const guchar *) &row1[x1];
+    const guchar * p01 = (const guchar *) &row1[x2];
+    const guchar * p10 = (const guchar *) &row2[x1];
+    const guchar * p11 = (const guchar *) &row2[x2];
+
+    for (gint c = 0; c < 4; c++)
+      acc.v[c] += p00[c] * w00 + p01[c] * w01 + p10[c] * w10 + p11[c] * w11;
+  }
+
+  static inline void
+  add_span (gint32        * acc,
+            const guchar  * data,
+            gint            stride,
+            const gint32  * index,
+            const gint32  * wtop,
+            const gint32  * wbot,
+            gint            count)
+  {
+    for (gint i = 0; i < count; i++, acc += 4)
+    {
+      const guchar * top = data + (size_t) index[i] * 4;
+      const guchar * bot = top + (size_t) stride * 4;
+
+      gint32 w00 = (gint16) wtop[i], w01 = wtop[i] >> 16;
+      gint32 w10 = (gint16) wbot[i], w11 = wbot[i] >> 16;
+
+      for (gint c = 0; c < 4; c++)
+        acc[c] += top[c] * w00 + top[c + 4] * w01 + bot[c] * w10 + bot[c + 4] * w11;
+    }
+  }
+
+  static inline void
+  store (const Acc & acc,
+         guchar    * out)
+  {
+    for (gint c = 0; c < 4; c++)
+    {
+      gint32 v = (acc.v[c] + (FIXED_POINT_ONE >> 1)) >> FIXED_POINT_SHIFT;
+      out[c] = (guchar) (v > 255 ? 255 : v);
+    }
+  }
+};
+
+#if VGLIC_X86
+
+/**********/
+/* SSE4.1 */
+/**********/
+
+struct FixedTapsSse41
+{
+  struct Acc
+  {
+    __m128i v;
+  };
+
+  __attribute__ ((target ("sse4.1")))
+  static inline void
+  zero (Acc & acc)
+  {
+    acc.v = _mm_setzero_si128 ();
+  }
+
+  /* The two texels of a row are interleaved per channel, so that one */
+  /* madd multiplies both by their weights and adds them together     */
+
+  __attribute__ ((target ("sse4.1")))
+  static inline void
+  add (Acc            & acc,
+       const guint32  * row1,
+       const guint32  * row2,
+       gint             x1,
+       gint             x2,
+       gint16           w00,
+       gint16           w01,
+       gint16           w10,
+       gint16           w11)
+  {
+    __m128i top = _mm_unpacklo_epi8 (_mm_cvtsi32_si128 ((gint32) row1[x1]),
+                                     _mm_cvtsi32_si128 ((gint32) row1[x2]));
+    __m128i bot = _mm_unpacklo_epi8 (_mm_cvtsi32_si128 ((gint32) row2[x1]),
+                                     _mm_cvtsi32_si128 ((gint32) row2[x2]));
+
+    __m128i wt = _mm_set1_epi32 ((gint32) (((guint32) (guint16) w01 << 16) | (guint16) w00));
+    __m128i wb = _mm_set1_epi32 ((gint32) (((guint32) (guint16) w11 << 16) | (guint16) w10));
+
+    acc.v = _mm_add_epi32 (acc.v, _mm_madd_epi16 (_mm_cvtepu8_epi16 (top), wt));
+    acc.v = _mm_add_epi32 (acc.v, _mm_madd_epi16 (_mm_cvtepu8_epi16 (bot), wb));
+  }
+
+  /* Both texels of a row are adjacent in memory, a shuffle puts */
+  /* them in the interleaved order expected by madd              */
+
+  __attribute__ ((target ("sse4.1")))
+  static inline void
+  add_span (gint32        * acc,
+            const guchar  * data,
+            gint            stride,
+            const gint32  * index,
+            const gint32  * wtop,
+            const gint32  * wbot,
+            gint            count)
+  {
+    const __m128i order = _mm_setr_epi8 (0, 4, 1, 5, 2, 6, 3, 7, 
+                                         -1, -1, -1, -1, -1, -1, -1, -1);
+
+    for (gint i = 0; i < count; i++, acc += 4)
+    {
+      const guchar * top = data + (size_t) index[i] * 4;
+      const guchar * bot = top + (size_t) stride * 4;
+
+      __m128i t = _mm_shuffle_epi8 (_mm_loadl_epi64 ((const __m128i *) top), order);
+      __m128i b = _mm_shuffle_epi8 (_mm_loadl_epi64 ((const __m128i *) bot), order);
+      __m128i a = _mm_loadu_si128 ((const __m128i *) acc);
+
+      a = _mm_add_epi32 (a, _mm_madd_epi16 (_mm_cvtepu8_epi16 (t), _mm_set1_epi32 (wtop[i])));
+      a = _mm_add_epi32 (a, _mm_madd_epi16 (_mm_cvtepu8_epi16 (b), _mm_set1_epi32 (wbot[i])));
+
+      _mm_storeu_si128 ((__m128i *) acc, a);
+    }
+  }
+
+  __attribute__ ((target ("sse4.1")))
+  static inline void
+  store (const Acc & acc,
+         guchar    * out)
+  {
+    __m128i v = _mm_add_epi32 (acc.v, _mm_set1_epi32 (FIXED_POINT_ONE >> 1));
+
+    v = _mm_srai_epi32 (v, FIXED_POINT_SHIFT);
+    v = _mm_packus_epi32 (v, v);
+    v = _mm_packus_epi16 (v, v);
+
+    gint32 packed = _mm_cvtsi128_si32 (v);
+    memcpy (out, &packed, 4);
+  }
+};
+
+/********/
+/* AVX2 */
+/********/
+
+struct FixedTapsAvx2
+{
+  struct Acc
+  {
+    __m256i v;
+  };
+
+  __attribute__ ((target ("avx2")))
+  static inline void
+  zero (Acc & acc)
+  {
+    acc.v = _mm256_setzero_si256 ();
+  }
+
+  /* Same as the SSE4.1 version, with both rows in one register */
+
+  __attribute__ ((target ("avx2")))
+  static inline void
+  add (Acc            & acc,
+       const guint32  * row1,
+       const guint32  * row2,
+       gint             x1,
+       gint             x2,
+       gint16           w00,
+       gint16           w01,
+       gint16           w10,
+       gint16           w11)
+  {
+    __m128i top = _mm_unpacklo_epi8 (_mm_cvtsi32_si128 ((gint32) row1[x1]),
+                                     _mm_cvtsi32_si128 ((gint32) row1[x2]));
+    __m128i bot = _mm_unpacklo_epi8 (_mm_cvtsi32_si128 ((gint32) row2[x1]),
+                                     _mm_cvtsi32_si128 ((gint32) row2[x2]));
+
+    gint32 wt = (gint32) (((guint32) (guint16) w01 << 16) | (guint16) w00);
+    gint32 wb = (gint32) (((guint32) (guint16) w11 << 16) | (guint16) w10);
+
+    __m256i texels  = _mm256_cvtepu8_epi16 (_mm_unpacklo_epi64 (top, bot));
+    __m256i weights = _mm256_setr_epi32 (wt, wt, wt, wt, wb, wb, wb, wb);
+
+    acc.v = _mm256_add_epi32 (acc.v, _mm256_madd_epi16 (texels, weights));
+  }
+
+  __attribute__ ((target ("avx2")))
+  static inline void
+  add_span (gint32        * acc,
+            const guchar  * data,
+            gint            stride,
+            const gint32  * index,
+            const gint32  * wtop,
+            const gint32  * wbot,
+            gint            count)
+  {
+    const __m128i order = _mm_setr_epi8 (0, 4, 1, 5, 2, 6, 3, 7, 
+                                         8, 12, 9, 13, 10, 14, 11, 15);
+
+    for (gint i = 0; i < count; i++, acc += 4)
+    {
+      const guchar * top = data + (size_t) index[i] * 4;
+      const guchar * bot = top + (size_t) stride * 4;
+
+      __m128i rows    = _mm_unpacklo_epi64 (_mm_loadl_epi64 ((const __m128i *) top),
+                                            _mm_loadl_epi64 ((const __m128i *) bot));
+      __m256i texels  = _mm256_cvtepu8_epi16 (_mm_shuffle_epi8 (rows, order));
+      __m256i weights = _mm256_setr_epi32 (wtop[i], wtop[i], wtop[i], wtop[i],
+                                           wbot[i], wbot[i], wbot[i], wbot[i]);
+      __m256i sum     = _mm256_madd_epi16 (texels, weights);
+
+      __m128i a = _mm_loadu_si128 ((const __m128i *) acc);
+      a = _mm_add_epi32 (a, _mm256_castsi256_si128 (sum));
+      a = _mm_add_epi32 (a, _mm256_extracti128_si256 (sum, 1));
+
+      _mm_storeu_si128 ((__m128i *) acc, a);
+    }
+  }
+
+  __attribute__ ((target ("avx2")))
+  static inline void
+  store (const Acc & acc,
+         guchar    * out)
+  {
+    __m128i v = _mm_add_epi32 (_mm256_castsi256_si128 (acc.v),
+                               _mm256_extracti128_si256 (acc.v, 1));
+
+    v = _mm_add_epi32 (v, _mm_set1_epi32 (FIXED_POINT_ONE >> 1));
+    v = _mm_srai_epi32 (v, FIXED_POINT_SHIFT);
+    v = _mm_packus_epi32 (v, v);
+    v = _mm_packus_epi16 (v, v);
+
+    gint32 packed = _mm_cvtsi128_si32 (v);
+    memcpy (out, &packed, 4);
+  }
+};
+
+#endif /* VGLIC_X86 */
+
+#endif /* VAN_GOGH_LIC_FIXED_HPP */
@@ -0,0 +1,337 @@
+/* Line Integral Convolution (LIC) - shared work-stealing thread pool
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * The threads behind VanGoghLIC::compute_async. Every job becomes one
+ * task, which splits its rows into more tasks of the same priority
+ * (parallel_rows) and runs the first band itself while the others are
+ * picked up by idle threads.
+ *
+ * Each thread has a deque of tasks per priority. It pushes and pops its
+ * own tasks at the back, and when it has none takes the oldest task
+ * submitted from outside the pool or steals the oldest one of another
+ * thread. Higher priorities are always looked at first, so the tasks of
+ * an interactive job start as soon as a thread finishes its current
+ * band of a batch job, and a batch job still gets every thread nobody
+ * else needs. A thread waiting for its bands helps with tasks of its own
+ * priority or higher in the meantime, and when none are left sleeps until
+ * the threads that took its last bands are done with them.
+ */
+
+#ifndef VAN_GOGH_LIC_POOL_HPP
+#define VAN_GOGH_LIC_POOL_HPP
+
+#include "libgimpcolor.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef enum
+{
+  PRIORITY_BATCH,
+  PRIORITY_NORMAL,
+  PRIORITY_INTERACTIVE
+} TaskPriority;
+
+#define POOL_PRIORITIES 3
+
+/* Rows of the output per task */
+
+#define POOL_TASK_ROWS 8
+
+class VanGoghLICPool
+{
+public:
+
+  typedef std::function<void ()> Task;
+
+  /* The pool of the process, with a thread per cpu */
+
+  static VanGoghLICPool &
+  shared (void)
+  {
+    static VanGoghLICPool pool (MAX ((gint) std::thread::hardware_concurrency (), 1));
+
+    return pool;
+  }
+
+  VanGoghLICPool (gint size) :
+    pending (0),
+    stopping (false)
+  {
+    gint i;
+
+    for (i = 0; i < size; i++)
+      workers.push_back (std::unique_ptr<Worker> (new Worker ()));
+
+    for (i = 0; i < size; i++)
+      threads.push_back (std::thread (&VanGoghLICPool::work, this, i));
+  }
+
+  /* Runs the tasks left, then stops the threads */
+
+  ~VanGoghLICPool ()
+  {
+    size_t i;
+
+    {
+      std::lock_guard<std::mutex> guard (sleep_lock);
+      stopping = true;
+    }
+
+    wake.notify_all ();
+
+    for (i = 0; i < threads.size (); i++)
+      threads[i].join ();
+  }
+
+  gint
+  size (void)
+  {
+    return (gint) threads.size ();
+  }
+
+  void
+  submit (TaskPriority priority,
+          Task task)
+  {
+    Worker * self = current_worker ();
+
+    if (self != nullptr)
+    {
+      std::lock_guard<std::mutex> guard (self->lock);
+      self->tasks[priority].push_back (std::move (task));
+    }
+    else
+    {
+      std::lock_guard<std::mutex> guard (injection_lock);
+      injected[priority].push_back (std::move (task));
+    }
+
+    {
+      std::lock_guard<std::mutex> guard (sleep_lock);
+      pending++;
+    }
+
+    wake.notify_one ();
+  }
+
+  /* Calls body (first, last) on bands of band_rows rows from first_row */
+  /* to last_row, as tasks of priority, and returns when all are done.  */
+  /* The first exception thrown by body is thrown again here.           */
+
+  template <typename Body>
+  void
+  parallel_rows (TaskPriority priority,
+                 gint first_row,
+                 gint last_row,
+                 gint band_rows,
+                 Body body)
+  {
+    std::atomic<gint>       remaining (0);
+    std::exception_ptr      error;
+    std::mutex              done_lock;
+    std::condition_variable done;
+    gint                    first;
+    Task                    task;
+
+    auto band = [&] (gint first, gint last)
+    {
+      std::exception_ptr band_error;
+
+      try
+      {
+        body (first, last);
+      }
+      catch (...)
+      {
+        band_error = std::current_exception ();
+      }
+
+      /* Under the lock: the waiter returns, destroying done, */
+      /* as soon as it sees remaining reach 0                 */
+
+      std::lock_guard<std::mutex> guard (done_lock);
+
+      if (band_error && !error)
+        error = band_error;
+
+      if (--remaining == 0)
+        done.notify_all ();
+    };
+
+    remaining = (last_row - first_row + band_rows - 1) / band_rows;
+
+    for (first = first_row + band_rows; first < last_row; first += band_rows)
+    {
+      gint last = MIN (first + band_rows, last_row);
+
+      submit (priority, [&band, first, last] () { band (first, last); });
+    }
+
+    band (first_row, MIN (first_row + band_rows, last_row));
+
+    /* No band of ours is queued once take fails, */
+    /* so the ones left are running somewhere     */
+
+    while (remaining > 0 && take (priority, task))
+      task ();
+
+    {
+      std::unique_lock<std::mutex> lock (done_lock);
+
+      done.wait (lock, [&remaining] () { return remaining == 0; });
+    }
+
+    if (error)
+      std::rethrow_exception (error);
+  }
+
+private:
+
+  typedef struct
+  {
+    std::mutex       lock;
+    std::deque<Task> tasks[POOL_PRIORITIES];
+  } Worker;
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread>             threads;
+  std::mutex                           injection_lock;
+  std::deque<Task>                     injected[POOL_PRIORITIES];
+  std::mutex                           sleep_lock;
+  std::condition_variable              wake;
+  std::atomic<gint>                    pending;
+  gboolean                             stopping;
+
+  /* The pool and worker of the calling thread, if it is one of ours */
+
+  static VanGoghLICPool * &
+  current_pool (void)
+  {
+    static thread_local VanGoghLICPool * pool = nullptr;
+
+    return pool;
+  }
+
+  static gint &
+  current_index (void)
+  {
+    static thread_local gint index = -1;
+
+    return index;
+  }
+
+  Worker *
+  current_worker (void)
+  {
+    return current_pool () == this ? workers[current_index ()].get () : nullptr;
+  }
+
+  /* The next task of priority minimum or higher: the newest of */
+  /* the calling thread, the oldest submitted from outside, or  */
+  /* the oldest of another thread, in that order                */
+
+  gboolean
+  take (TaskPriority minimum,
+        Task & task)
+  {
+    Worker * self  = current_worker ();
+    gint     start = current_pool () == this ? current_index () + 1 : 0;
+    gint     priority;
+    size_t   i;
+
+    for (priority = POOL_PRIORITIES - 1; priority >= minimum; priority--)
+    {
+      if (self != nullptr)
+      {
+        std::lock_guard<std::mutex> guard (self->lock);
+
+        if (!self->tasks[priority].empty ())
+        {
+          task = std::move (self->tasks[priority].back ());
+          self->tasks[priority].pop_back ();
+          pending--;
+          return true;
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> guard (injection_lock);
+
+        if (!injected[priority].empty ())
+        {
+          task = std::move (injected[priority].front ());
+          injected[priority].pop_front ();
+          pending--;
+          return true;
+        }
+      }
+
+      for (i = 0; i < workers.size (); i++)
+      {
+        Worker * victim = workers[(start + i) % workers.size ()].get ();
+
+        if (victim == self)
+          continue;
+
+        std::lock_guard<std::mutex> guard (victim->lock);
+
+        if (!victim->tasks[priority].empty ())
+        {
+          task = std::move (victim->tasks[priority].front ());
+          victim->tasks[priority].pop_front ();
+          pending--;
+          return true;
+        }
+      }
+    }
+
+    return false;
+  }
+
+  void
+  work (gint index)
+  {
+    current_pool ()  = this;
+    current_index () = index;
+
+    while (true)
+    {
+      Task task;
+
+      if (take (PRIORITY_BATCH, task))
+      {
+        task ();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock (sleep_lock);
+
+      wake.wait (lock, [this] () { return stopping || pending > 0; });
+
+      if (stopping && pending <= 0)
+        return;
+    }
+  }
+};
+
+#endif /* VAN_GOGH_LIC_POOL_HPP */
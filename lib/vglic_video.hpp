@@ -0,0 +1,252 @@
+/* Line Integral Convolution (LIC) - incremental rendering of video frames
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Renders the frames of a video one after the other, and only re-renders
+ * the pixels whose output can differ from the previous frame. An output
+ * pixel reads the input along its streamline, at most filter_length
+ * pixels away, plus the bilinear footprint of the last sample; both fit
+ * in halo_rows () pixels, wrapping around the edges like the samples.
+ * The input is compared with the previous frame in tiles of
+ * VIDEO_TILE_SIZE pixels. The changed tiles are dilated by that reach and
+ * merged into rectangles, which VanGoghLIC::render computes. The other
+ * pixels keep the previous output, so each frame is identical to a full
+ * render.
+ *
+ * The effect and the parameters of the VanGoghLIC must stay the same from
+ * one frame to the next: call reset after changing them.
+ */
+
+#ifndef VAN_GOGH_LIC_VIDEO_HPP
+#define VAN_GOGH_LIC_VIDEO_HPP
+
+#include "vglic.hpp"
+
+#include <cstring>
+#include <vector>
+
+#define VIDEO_TILE_SIZE 16
+
+class VanGoghLICVideo
+{
+public:
+
+  VanGoghLICVideo (VanGoghLIC & lic) :
+    lic (lic),
+    previous_alpha (DETECT_ALPHA),
+    rendered_pixels (0)
+  {
+  }
+
+  /* The next frame is rendered whole */
+
+  void
+  reset (void)
+  {
+    previous_input.release ();
+  }
+
+  /* Renders input_image, the next frame, into output_image. */
+  /* lic must have been prepared with the effect image.      */
+
+  void
+  compute (cv::Mat & input_image,
+           cv::Mat & output_image)
+  {
+    InputAlpha saved_alpha = lic.input_alpha;
+    InputAlpha alpha       = lic.detect_alpha (input_image);
+    size_t     i;
+
+    /* The opaque and translucent kernels round differently, */
+    /* so a frame that changes between them is redone whole  */
+
+    gboolean whole = previous_input.empty () ||
+                     previous_input.rows != input_image.rows ||
+                     previous_input.cols != input_image.cols ||
+                     previous_input.type () != input_image.type () ||
+                     frame_output.type () != lic.output_type (input_image.type ()) ||
+                     alpha != previous_alpha;
+
+    areas.clear ();
+
+    if (whole)
+      areas.push_back (cv::Rect (0, 0, input_image.cols, input_image.rows));
+    else
+      find_areas (input_image);
+
+    lic.input_alpha = alpha;
+    rendered_pixels = 0;
+
+    for (i = 0; i < areas.size (); i++)
+    {
+      lic.render (input_image, frame_output, areas[i]);
+      rendered_pixels += (gint64) areas[i].width * areas[i].height;
+    }
+
+    lic.input_alpha = saved_alpha;
+    previous_alpha  = alpha;
+
+    input_image.copyTo (previous_input);
+    frame_output.copyTo (output_image);
+  }
+
+  /* The rectangles rendered by the last compute */
+
+  const std::vector<cv::Rect> &
+  dirty_areas (void)
+  {
+    return areas;
+  }
+
+  /* The part of the last frame that was rendered, from 0 to 1 */
+
+  gdouble
+  rendered_fraction (void)
+  {
+    if (frame_output.empty ())
+      return 0.0;
+
+    return (gdouble) rendered_pixels / ((gdouble) frame_output.cols * frame_output.rows);
+  }
+
+private:
+
+  VanGoghLIC &          lic;
+  cv::Mat               previous_input;
+  cv::Mat               frame_output;
+  InputAlpha            previous_alpha;
+  std::vector<cv::Rect> areas;
+  gint64                rendered_pixels;
+
+  /* The tiles holding pixels a to b - 1 of a side of size */
+  /* pixels, the pixels wrapping around it                 */
+
+  static void
+  wrapped_tiles (gint a,
+                 gint b,
+                 gint size,
+                 std::vector<gint> & tiles)
+  {
+    gint t;
+
+    tiles.clear ();
+
+    if (b - a >= size)
+    {
+      a = 0;
+      b = size;
+    }
+    else
+    {
+      b -= a;
+      a  = (a % size + size) % size;
+      b += a;
+    }
+
+    for (t = a / VIDEO_TILE_SIZE; t <= (MIN (b, size) - 1) / VIDEO_TILE_SIZE; t++)
+      tiles.push_back (t);
+
+    if (b > size)
+      for (t = 0; t <= (b - size - 1) / VIDEO_TILE_SIZE; t++)
+        tiles.push_back (t);
+  }
+
+  void
+  find_areas (cv::Mat & input_image)
+  {
+    gint   width   = input_image.cols;
+    gint   height  = input_image.rows;
+    gint   tiles_x = (width + VIDEO_TILE_SIZE - 1) / VIDEO_TILE_SIZE;
+    gint   tiles_y = (height + VIDEO_TILE_SIZE - 1) / VIDEO_TILE_SIZE;
+    size_t pixel   = input_image.elemSize ();
+    gint   x, y, tx, ty;
+    size_t i, j;
+
+    /* White noise only reads the pixel itself */
+
+    gint reach = lic.convolve_with == WHITE_NOISE ? 0 : lic.halo_rows ();
+
+    std::vector<guchar> changed ((size_t) tiles_x * tiles_y, false);
+    std::vector<guchar> dirty ((size_t) tiles_x * tiles_y, false);
+    std::vector<gint>   columns, rows;
+
+    for (y = 0; y < height; y++)
+    {
+      const guchar * row      = input_image.ptr<guchar> (y);
+      const guchar * previous = previous_input.ptr<guchar> (y);
+
+      for (tx = 0; tx < tiles_x; tx++)
+      {
+        x = tx * VIDEO_TILE_SIZE;
+
+        if (memcmp (row + x * pixel, previous + x * pixel,
+                    MIN (VIDEO_TILE_SIZE, width - x) * pixel) != 0)
+          changed[(size_t) (y / VIDEO_TILE_SIZE) * tiles_x + tx] = true;
+      }
+    }
+
+    /* Every tile within reach of a changed one */
+
+    for (ty = 0; ty < tiles_y; ty++)
+      for (tx = 0; tx < tiles_x; tx++)
+      {
+        if (!changed[(size_t) ty * tiles_x + tx])
+          continue;
+
+        wrapped_tiles (tx * VIDEO_TILE_SIZE - reach,
+                       MIN ((tx + 1) * VIDEO_TILE_SIZE, width) + reach, width, columns);
+        wrapped_tiles (ty * VIDEO_TILE_SIZE - reach,
+                       MIN ((ty + 1) * VIDEO_TILE_SIZE, height) + reach, height, rows);
+
+        for (i = 0; i < rows.size (); i++)
+          for (j = 0; j < columns.size (); j++)
+            dirty[(size_t) rows[i] * tiles_x + columns[j]] = true;
+      }
+
+    /* Runs of dirty tiles along each row of tiles, joined with */
+    /* the run right above when they span the same columns      */
+
+    for (ty = 0; ty < tiles_y; ty++)
+    {
+      y = ty * VIDEO_TILE_SIZE;
+
+      for (tx = 0; tx < tiles_x; tx++)
+      {
+        if (!dirty[(size_t) ty * tiles_x + tx])
+          continue;
+
+        gint first = tx;
+
+        while (tx < tiles_x && dirty[(size_t) ty * tiles_x + tx])
+          tx++;
+
+        cv::Rect run (first * VIDEO_TILE_SIZE, y,
+                      MIN (tx * VIDEO_TILE_SIZE, width) - first * VIDEO_TILE_SIZE,
+                      MIN (VIDEO_TILE_SIZE, height - y));
+
+        for (i = 0; i < areas.size (); i++)
+          if (areas[i].x == run.x && areas[i].width == run.width &&
+              areas[i].y + areas[i].height == y)
+            break;
+
+        if (i < areas.size ())
+          areas[i].height += run.height;
+        else
+          areas.push_back (run);
+      }
+    }
+  }
+};
+
+#endif /* VAN_GOGH_LIC_VIDEO_HPP */
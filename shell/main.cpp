@@ -1,5 +1,9 @@
 
 #include "vglic.hpp"
+#include "vglic_autotune.hpp"
+#include "vglic_video.hpp"
+#include "sharding.hpp"
+#include "perf_counters.hpp"
 
 void
 error(const char * msg)
@@ -55,7 +59,7 @@ public:
         return std::stoi(argv[pos]);
     }
 
-    int nextDouble() {
+    double nextDouble() {
         next();
         return std::stod(argv[pos]);
     }
@@ -81,18 +85,143 @@ public:
 };
 
 void
-read_image_as_64FC4(const char * filepath, cv::Mat & result)
+read_image_as_8UC4(const char * filepath, cv::Mat & result)
 {
     cv::Mat original = cv::imread(filepath);
 
     if (original.empty())
         error("Failed to open image file", filepath);
 
+    cv::cvtColor(original, result, cv::COLOR_BGR2BGRA);
+}
+
+void
+read_image_as_64FC4(const char * filepath, cv::Mat & result)
+{
     cv::Mat as_rgba;
-    cv::cvtColor(original, as_rgba, cv::COLOR_BGR2BGRA);
+    read_image_as_8UC4(filepath, as_rgba);
     as_rgba.convertTo(result, CV_64FC4, 1.0/255.0);
 }
 
+// --variants FILTER_LENGTH[:INTEGRATION_STEPS[:EFFECT_OPERATOR]],... 
+// Missing values are taken from the other options
+
+void
+parse_variants(const char * list, VanGoghLIC & lic, 
+               std::map<std::string, EffectOperator> & effect_operator_choices, 
+               std::vector<RenderVariant> & variants)
+{
+    std::stringstream entries(list);
+    std::string entry;
+
+    while (std::getline(entries, entry, ','))
+    {
+        std::stringstream fields(entry);
+        std::string field;
+        RenderVariant variant = { lic.filter_length, lic.integration_steps, lic.effect_operator };
+
+        try
+        {
+            if (std::getline(fields, field, ':'))
+                variant.filter_length = std::stod(field);
+
+            if (std::getline(fields, field, ':'))
+                variant.integration_steps = std::stod(field);
+        }
+        catch (const std::exception &)
+        {
+            error("Invalid variant", entry.c_str());
+        }
+
+        if (std::getline(fields, field, ':'))
+        {
+            auto it = effect_operator_choices.find(field);
+
+            if (it == effect_operator_choices.end())
+                error("Invalid variant", entry.c_str());
+
+            variant.effect_operator = it->second;
+        }
+
+        variants.push_back(variant);
+    }
+}
+
+// out.png becomes out_1.png, out_2.png, ... for the variants
+
+std::string
+variant_filepath(const char * filepath, size_t index)
+{
+    std::string path(filepath);
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of('/');
+
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = path.size();
+
+    return path.substr(0, dot) + "_" + std::to_string(index + 1) + path.substr(dot);
+}
+
+void
+run_lic(VanGoghLIC & lic, ShardCoordinator & shards, std::vector<RenderVariant> & variants,
+        cv::Mat & input_image, cv::Mat & effect_image, 
+        cv::Mat & output_image, std::vector<cv::Mat> & variant_images)
+{
+    // effect_image is empty when the fields were mapped from a cache file
+
+    if (!effect_image.empty())
+        lic.prepare(effect_image);
+
+    if (!variants.empty())
+        lic.render(input_image, variants, variant_images, 0, input_image.rows);
+    else if (shards.empty())
+        lic.render(input_image, output_image, 0, input_image.rows);
+    else
+        shards.render(lic, input_image, output_image);
+}
+
+// --frames N renders frames 1 to N of a video, --input and --output being 
+// printf patterns such as frame_%04d.png. Each frame only re-renders the 
+// pixels that can differ from the previous one
+
+void
+run_frames(VanGoghLIC & lic, int frames, const char * input_pattern, const char * output_pattern,
+           cv::Mat & effect_image, bool load_profile, const char * autotune_filepath)
+{
+    VanGoghLICVideo video(lic);
+    char path[4096];
+
+    if (!effect_image.empty())
+        lic.prepare(effect_image);
+
+    for (int frame = 1; frame <= frames; ++frame)
+    {
+        cv::Mat input_image;
+        cv::Mat output_image;
+
+        snprintf(path, sizeof(path), input_pattern, frame);
+
+        if (lic.arithmetic == FIXED_POINT)
+            read_image_as_8UC4(path, input_image);
+        else
+            read_image_as_64FC4(path, input_image);
+
+        if (frame == 1 && load_profile)
+            autotune_load_profile(lic, input_image.cols, input_image.rows, autotune_filepath);
+
+        int64 start = cv::getTickCount();
+        video.compute(input_image, output_image);
+        double elapsed = (cv::getTickCount() - start) / cv::getTickFrequency();
+
+        snprintf(path, sizeof(path), output_pattern, frame);
+        cv::imwrite(path, output_image);
+
+        std::cout << "frame " << frame << ": " << video.dirty_areas().size() << " areas, " 
+                  << video.rendered_fraction() * 100.0 << "% of the pixels rendered in " 
+                  << elapsed * 1000.0 << " ms" << std::endl;
+    }
+}
+
 int main(int argc, char * argv[])
 {
 
@@ -101,6 +230,17 @@ int main(int argc, char * argv[])
     char const * input_filepath = nullptr;
     char const * effect_filepath = nullptr;
     char const * output_filepath = nullptr;
+    int benchmark_runs = 0;
+    int frames = 0;
+    int local_shards = 0;
+    int shard_serve_port = 0;
+    char const * shard_bind_address = "127.0.0.1";
+    char const * shard_hosts = nullptr;
+    char const * effect_cache_filepath = nullptr;
+    char const * variants_list = nullptr;
+    char const * autotune_filepath = "";
+    bool run_autotune = false;
+    bool tuned_by_hand = false;
 
     VanGoghLIC lic;
 
@@ -120,6 +260,46 @@ int main(int argc, char * argv[])
     convolve_with_choices["WHITE_NOISE"]  = WHITE_NOISE;
     convolve_with_choices["SOURCE_IMAGE"] = SOURCE_IMAGE;
 
+    std::map<std::string, EffectScaling> effect_scaling_choices;
+    effect_scaling_choices["TILE"]    = TILE;
+    effect_scaling_choices["STRETCH"] = STRETCH;
+
+    std::map<std::string, Streamline> streamline_choices;
+    streamline_choices["STRAIGHT"] = STRAIGHT;
+    streamline_choices["CURVED"]   = CURVED;
+
+    std::map<std::string, ImageLayout> image_layout_choices;
+    image_layout_choices["INTERLEAVED"] = INTERLEAVED;
+    image_layout_choices["PLANAR"]      = PLANAR;
+
+    std::map<std::string, InputAlpha> input_alpha_choices;
+    input_alpha_choices["DETECT"]      = DETECT_ALPHA;
+    input_alpha_choices["OPAQUE"]      = OPAQUE;
+    input_alpha_choices["TRANSLUCENT"] = TRANSLUCENT;
+
+    std::map<std::string, Arithmetic> arithmetic_choices;
+    arithmetic_choices["FLOATING_POINT"] = FLOATING_POINT;
+    arithmetic_choices["FIXED_POINT"]    = FIXED_POINT;
+
+    std::map<std::string, OutputDepth> output_depth_choices;
+    output_depth_choices["8U"]  = OUTPUT_8U;
+    output_depth_choices["16U"] = OUTPUT_16U;
+
+    std::map<std::string, Quantization> quantization_choices;
+    quantization_choices["ROUND"]          = ROUND;
+    quantization_choices["ORDERED_DITHER"] = ORDERED_DITHER;
+
+    std::map<std::string, Traversal> traversal_choices;
+    traversal_choices["ROW_MAJOR"] = ROW_MAJOR;
+    traversal_choices["BLOCKED"]   = BLOCKED;
+    traversal_choices["Z_ORDER"]   = Z_ORDER;
+
+    std::map<std::string, InstructionSet> instruction_set_choices;
+    instruction_set_choices["DETECT"] = DETECT_ISA;
+    instruction_set_choices["SSE2"]   = ISA_SSE2;
+    instruction_set_choices["AVX2"]   = ISA_AVX2;
+    instruction_set_choices["AVX512"] = ISA_AVX512;
+
     BasicArgumentParser parser(argc, argv);
 
     while (parser.hasNext())
@@ -158,32 +338,318 @@ int main(int argc, char * argv[])
             
         else if (parser.has("--convolve-with"))
             lic.convolve_with = parser.nextChoice(convolve_with_choices);
+
+        else if (parser.has("--effect-scaling"))
+            lic.effect_scaling = parser.nextChoice(effect_scaling_choices);
+
+        else if (parser.has("--streamline"))
+            lic.streamline = parser.nextChoice(streamline_choices);
+
+        else if (parser.has("--streamline-tolerance"))
+            lic.streamline_tolerance = parser.nextDouble();
+
+        else if (parser.has("--image-layout"))
+        {
+            lic.image_layout = parser.nextChoice(image_layout_choices);
+            tuned_by_hand = true;
+        }
+
+        else if (parser.has("--input-alpha"))
+            lic.input_alpha = parser.nextChoice(input_alpha_choices);
+
+        else if (parser.has("--arithmetic"))
+            lic.arithmetic = parser.nextChoice(arithmetic_choices);
+
+        else if (parser.has("--output-depth"))
+            lic.output_depth = parser.nextChoice(output_depth_choices);
+
+        else if (parser.has("--quantization"))
+            lic.quantization = parser.nextChoice(quantization_choices);
+
+        else if (parser.has("--traversal"))
+        {
+            lic.traversal = parser.nextChoice(traversal_choices);
+            tuned_by_hand = true;
+        }
+
+        else if (parser.has("--block-size"))
+        {
+            lic.block_size = parser.nextInt();
+            tuned_by_hand = true;
+        }
+
+        else if (parser.has("--threads"))
+        {
+            lic.num_threads = parser.nextInt();
+            tuned_by_hand = true;
+        }
+
+        else if (parser.has("--instruction-set"))
+            lic.instruction_set = parser.nextChoice(instruction_set_choices);
+
+        else if (parser.has("--autotune"))
+            run_autotune = true;
+
+        else if (parser.has("--autotune-profile"))
+            autotune_filepath = parser.nextCharPtr();
+
+        else if (parser.has("--dither-seed"))
+            lic.dither_seed = parser.nextInt();
+
+        else if (parser.has("--effect-cache"))
+            effect_cache_filepath = parser.nextCharPtr();
+
+        else if (parser.has("--variants"))
+            variants_list = parser.nextCharPtr();
+
+        else if (parser.has("--frames"))
+            frames = parser.nextInt();
+
+        else if (parser.has("--benchmark"))
+            benchmark_runs = parser.nextInt();
+
+        else if (parser.has("--shards"))
+            local_shards = parser.nextInt();
+
+        else if (parser.has("--shard-hosts"))
+            shard_hosts = parser.nextCharPtr();
+
+        else if (parser.has("--shard-serve"))
+            shard_serve_port = parser.nextInt();
+
+        else if (parser.has("--shard-bind"))
+            shard_bind_address = parser.nextCharPtr();
         
         else
             error("Unexpected parameter", parser.current());
     }
 
+    // Running the kernels for an instruction set the cpu lacks would crash
+
+    if (lic.instruction_set > VanGoghLIC::supported_instruction_set())
+        error("The cpu does not support --instruction-set", 
+              VanGoghLIC::instruction_set_name(lic.instruction_set));
+
+    // The fixed point kernel rounds each pixel to 8 bits as it goes
+
+    if (lic.arithmetic == FIXED_POINT && lic.quantization == ORDERED_DITHER)
+        error("--quantization ORDERED_DITHER can not be combined with --arithmetic FIXED_POINT");
+
+    // Run as a shard worker for coordinators on other machines
+
+    if (shard_serve_port > 0)
+    {
+        try
+        {
+            serve_shards(shard_bind_address, shard_serve_port);
+        }
+        catch (const std::exception & e)
+        {
+            error("Failed to serve shards", e.what());
+        }
+
+        return 0;
+    }
+
+    // Find the fastest settings for this machine, --filter-length and the 
+    // size of --input (512x512 without it) and save them for later runs
+
+    if (run_autotune)
+    {
+        cv::Mat input_image;
+        int width = 512;
+        int height = 512;
+
+        if (input_filepath != nullptr)
+        {
+            read_image_as_8UC4(input_filepath, input_image);
+            width = input_image.cols;
+            height = input_image.rows;
+        }
+
+        AutotuneProfile profile = autotune(lic, width, height);
+
+        std::cout << "autotune: " << profile.cpu_model << ", filter length " 
+                  << profile.filter_length << ", " << width << "x" << height << ": " 
+                  << autotune_layout_names[profile.image_layout] << " "
+                  << autotune_traversal_names[profile.traversal] << ", block size " 
+                  << profile.block_size << ", " << profile.num_threads << " threads, " 
+                  << profile.mpixels_per_second << " Mpixel/s" << std::endl;
+
+        std::string profile_path = autotune_filepath[0] != '\0' ? autotune_filepath : autotune_default_path();
+
+        if (!autotune_save_profile(profile, profile_path))
+            error("Failed to write the autotune profile", profile_path.c_str());
+
+        return 0;
+    }
+
     if (input_filepath == nullptr)
         error("Missing parameter --input");
     
     if (effect_filepath == nullptr)
         error("Missing parameter --effect");
+
+    std::vector<RenderVariant> variants;
+    std::vector<cv::Mat> variant_images;
+
+    if (variants_list != nullptr)
+    {
+        parse_variants(variants_list, lic, effect_operator_choices, variants);
+
+        if (output_filepath == nullptr)
+            error("Missing parameter --output, required by --variants");
+
+        if (local_shards > 0 || shard_hosts != nullptr)
+            error("--variants can not be combined with sharded rendering");
+    }
+
+    if (frames > 0)
+    {
+        if (output_filepath == nullptr)
+            error("Missing parameter --output, required by --frames");
+
+        if (local_shards > 0 || shard_hosts != nullptr || variants_list != nullptr)
+            error("--frames can not be combined with --variants or sharded rendering");
+    }
     
 
-    // Load images. They must by in CV_64FC4
+    // Files are written with 8 bits per channel unless told otherwise, 
+    // quantized by compute itself as each row is finished
+
+    if (output_filepath != nullptr && lic.output_depth == MATCH_INPUT)
+        lic.output_depth = OUTPUT_8U;
+
+
+    // Start the shard workers before loading the images, so that local 
+    // workers do not inherit a copy of them
+
+    ShardCoordinator shards;
+
+    if (local_shards > 0)
+        shards.spawnLocal(local_shards);
+
+    if (shard_hosts != nullptr)
+        shards.connectRemote(shard_hosts);
+
+
+    // Load images. They must by in CV_64FC4, or CV_8UC4 for the 
+    // fixed point kernel
 
     cv::Mat effect_image;
     cv::Mat input_image;
 
-    read_image_as_64FC4(effect_filepath, effect_image);
-    read_image_as_64FC4(input_filepath, input_image);
+    // The effect cache is only used when it was made from the same 
+    // effect file (same size and contents) and settings
+
+    struct stat effect_stat;
+    memset(&effect_stat, 0, sizeof(effect_stat));
+    guint64 effect_hash = 0;
+
+    if (effect_cache_filepath != nullptr)
+    {
+        stat(effect_filepath, &effect_stat);
+        effect_hash = effect_cache_hash(effect_filepath);
+    }
+
+    bool cached = effect_cache_filepath != nullptr &&
+                  lic.load_effect_cache(effect_cache_filepath, effect_stat.st_size, effect_hash);
+
+    if (!cached)
+        read_image_as_64FC4(effect_filepath, effect_image);
+
+    if (frames > 0)
+    {
+        run_frames(lic, frames, input_filepath, output_filepath, effect_image, 
+                   !tuned_by_hand, autotune_filepath);
+
+        if (effect_cache_filepath != nullptr && !cached &&
+            !lic.save_effect_cache(effect_cache_filepath, effect_stat.st_size, effect_hash))
+            error("Failed to write the effect cache", effect_cache_filepath);
+
+        return 0;
+    }
+
+    if (lic.arithmetic == FIXED_POINT)
+        read_image_as_8UC4(input_filepath, input_image);
+    else
+        read_image_as_64FC4(input_filepath, input_image);
+
+    // Settings given on the command line win over the autotune profile
+
+    if (!tuned_by_hand)
+        autotune_load_profile(lic, input_image.cols, input_image.rows, autotune_filepath);
     
 
     // Apply VanGoghLIC
 
     cv::Mat output_image;
 
-    lic.compute(input_image, effect_image, output_image);
+    run_lic(lic, shards, variants, input_image, effect_image, output_image, variant_images);
+
+    if (effect_cache_filepath != nullptr && !cached)
+    {
+        if (!lic.save_effect_cache(effect_cache_filepath, effect_stat.st_size, effect_hash))
+            error("Failed to write the effect cache", effect_cache_filepath);
+
+        effect_image.release();
+    }
+
+
+    // Optionally, time a few more runs and report the average
+
+    if (benchmark_runs > 0)
+    {
+        // prepare does not depend on the input: it is timed once, and 
+        // the runs only render (run_lic skips it without an effect image)
+
+        cv::Mat prepared;
+        int64 start = cv::getTickCount();
+
+        if (!effect_image.empty())
+        {
+            lic.prepare(effect_image);
+
+            std::cout << "prepare: " 
+                      << (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency() 
+                      << " ms" << std::endl;
+        }
+        else
+            std::cout << "prepare: not timed, the fields come from the effect cache" << std::endl;
+
+        CacheMissCounters counters;
+
+        counters.start();
+        start = cv::getTickCount();
+
+        for (int i = 0; i < benchmark_runs; ++i)
+            run_lic(lic, shards, variants, input_image, prepared, output_image, variant_images);
+
+        double elapsed = (cv::getTickCount() - start) / cv::getTickFrequency();
+        counters.stop();
+
+        double pixels = (double) input_image.total() * benchmark_runs;
+
+        std::cout << "render: " << elapsed * 1000.0 / benchmark_runs 
+                  << " ms per run (" << benchmark_runs << " runs, " 
+                  << input_image.cols << "x" << input_image.rows << ", " 
+                  << pixels / elapsed / 1e6 << " Mpixel/s, " 
+                  << VanGoghLIC::instruction_set_name(lic.active_instruction_set()) 
+                  << " kernels)" << std::endl;
+
+        // The workers count the samples of sharded renders
+
+        if (shards.empty())
+            std::cout << "samples per pixel: " << lic.samples_per_pixel() << std::endl;
+
+        // Misses of the shard workers are not counted
+
+        if (counters.available())
+            std::cout << "cache misses per pixel: L1D " << counters.l1dMisses() / pixels
+                      << ", LLC " << counters.llcMisses() / pixels << std::endl;
+        else
+            std::cout << "cache misses: hardware counters unavailable" << std::endl;
+    }
 
 
     // Display image if output filepath is not set
@@ -199,11 +665,15 @@ int main(int argc, char * argv[])
 
     // Otherwise, export the image to output_filepath
 
+    else if (variants.empty())
+    {
+        cv::imwrite(output_filepath, output_image);
+    }
+
     else
     {
-        cv::Mat tmp;
-        output_image.convertTo(tmp, CV_8UC4, 255.0);
-        cv::imwrite(output_filepath, tmp);
+        for (size_t i = 0; i < variant_images.size(); ++i)
+            cv::imwrite(variant_filepath(output_filepath, i), variant_images[i]);
     }
 
     return 0;
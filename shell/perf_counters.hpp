@@ -0,0 +1,129 @@
+/* Cache miss counters for vglic --benchmark
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Counts L1 data cache read misses and last level cache misses of this
+ * process with perf_event_open, including the threads it starts after
+ * the counters are opened, which renders do. Counters the kernel refuses (no PMU in a
+ * VM, perf_event_paranoid > 2, not Linux) are reported as unavailable.
+ */
+
+#ifndef VGLIC_PERF_COUNTERS_HPP
+#define VGLIC_PERF_COUNTERS_HPP
+
+#include <cstring>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+class CacheMissCounters
+{
+private:
+
+    int l1d_fd;
+    int llc_fd;
+
+    static int
+    open_counter(unsigned int type, unsigned long long config) {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+
+        attr.type = type;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+
+        return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+        return -1;
+#endif
+    }
+
+    static long long
+    read_counter(int fd) {
+        long long value = -1;
+
+        if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+            return -1;
+
+        return value;
+    }
+
+public:
+
+    CacheMissCounters() {
+#ifdef __linux__
+        l1d_fd = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        llc_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+        l1d_fd = llc_fd = -1;
+#endif
+    }
+
+    ~CacheMissCounters() {
+        if (l1d_fd >= 0)
+            close(l1d_fd);
+
+        if (llc_fd >= 0)
+            close(llc_fd);
+    }
+
+    bool available() {
+        return l1d_fd >= 0 || llc_fd >= 0;
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int fd : { l1d_fd, llc_fd })
+        {
+            if (fd < 0)
+                continue;
+
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (int fd : { l1d_fd, llc_fd })
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+    }
+
+    // -1 when the counter is not available
+
+    long long l1dMisses() {
+        return read_counter(l1d_fd);
+    }
+
+    long long llcMisses() {
+        return read_counter(llc_fd);
+    }
+
+};
+
+#endif /* VGLIC_PERF_COUNTERS_HPP */
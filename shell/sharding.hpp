@@ -0,0 +1,575 @@
+/* Sharded rendering for vglic
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * The coordinator splits the output into one band of rows per worker and
+ * sends each worker the parameters, the rows of the scalar field its band
+ * looks up (plus one row for the Sobel kernel) and the input rows it
+ * samples (plus halo_rows above and below). Workers render their band
+ * with VanGoghLIC::render and send it back. The effect image is reduced
+ * to its scalar field by the coordinator (or read from its effect cache),
+ * as the dithering runs sequentially over the whole image. The input
+ * alpha is also detected there, so that every band uses the same kernel
+ * and the stitched image is identical to a single process render.
+ *
+ * Workers are either forked locally and talk through a socketpair, or
+ * run as `vglic --shard-serve PORT` on any machine and are reached over
+ * TCP. Both use the same protocol, in the native byte order. The protocol
+ * has no authentication: TCP workers listen on the loopback address
+ * unless given another one, and bound the sizes and thread counts they
+ * are asked for.
+ */
+
+#ifndef VGLIC_SHARDING_HPP
+#define VGLIC_SHARDING_HPP
+
+#include "vglic.hpp"
+
+#include <cerrno>
+#include <sstream>
+#include <stdexcept>
+
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SHARD_MAGIC   0x534c4756
+#define SHARD_VERSION 7
+
+// Largest images a worker accepts, in pixels per side and in total
+
+#define SHARD_MAX_SIDE   65536
+#define SHARD_MAX_PIXELS ((int64_t) 1 << 28)
+
+struct ShardRequest
+{
+    uint32_t magic;
+    uint32_t version;
+
+    double filter_length;
+    double noise_magnitude;
+    double integration_steps;
+    double minimum_value;
+    double maximum_value;
+    double streamline_tolerance;
+
+    int32_t effect_channel;
+    int32_t effect_operator;
+    int32_t convolve_with;
+    int32_t effect_scaling;
+    int32_t streamline;
+    int32_t image_layout;
+    int32_t input_alpha;
+    int32_t arithmetic;
+    int32_t output_depth;
+    int32_t quantization;
+    int32_t traversal;
+    int32_t block_size;
+    int32_t num_threads;
+    int32_t instruction_set;
+
+    int32_t width;           // input image
+    int32_t height;
+    int32_t type;
+    int32_t first_row;       // band to render
+    int32_t last_row;
+    int32_t input_first;     // input rows that follow, wrapping around
+    int32_t input_count;
+
+    int32_t effect_width;    // scalar field
+    int32_t effect_height;
+    int32_t effect_first;    // scalar field rows that follow, wrapping around
+    int32_t effect_count;
+};
+
+struct ShardResponse
+{
+    uint32_t magic;
+    int32_t  status;         // 0, or the length of an error message that follows
+    int32_t  type;           // output rows first_row to last_row follow
+    int32_t  first_row;
+    int32_t  last_row;
+};
+
+
+/*****************/
+/* Socket helper */
+/*****************/
+
+bool
+write_all(int fd, const void * data, size_t size)
+{
+    const char * p = (const char *) data;
+
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+bool
+read_all(int fd, void * data, size_t size)
+{
+    char * p = (char *) data;
+
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+bool
+write_rows(int fd, cv::Mat & image, int first, int count)
+{
+    for (int i = 0; i < count; ++i)
+        if (!write_all(fd, image.ptr((first + i) % image.rows), image.cols * image.elemSize()))
+            return false;
+
+    return true;
+}
+
+bool
+read_rows(int fd, cv::Mat & image, int first, int count)
+{
+    for (int i = 0; i < count; ++i)
+        if (!read_all(fd, image.ptr((first + i) % image.rows), image.cols * image.elemSize()))
+            return false;
+
+    return true;
+}
+
+
+/**********/
+/* Worker */
+/**********/
+
+// A full size image backed by an anonymous mapping. Only the pages of
+// the rows a worker writes are ever allocated, so a worker needs about
+// as much memory as its band and halo no matter how big the image is.
+
+class ShardCanvas
+{
+private:
+
+    void * data;
+    size_t size;
+
+public:
+
+    cv::Mat image;
+
+    ShardCanvas(int rows, int cols, int type) :
+        data(nullptr),
+        size(0)
+    {
+        size_t elem_size = type == CV_8UC4 ? 4 : type == CV_16UC4 ? 8 : sizeof(GimpRGBA);
+
+        size = (size_t) rows * cols * elem_size;
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (data == MAP_FAILED)
+            throw std::runtime_error("Failed to map the shard canvas");
+
+        image = cv::Mat(rows, cols, type, data);
+    }
+
+    ~ShardCanvas() {
+        image.release();
+        munmap(data, size);
+    }
+
+};
+
+void
+send_shard_error(int fd, const char * msg)
+{
+    ShardResponse response = { SHARD_MAGIC, (int32_t) strlen(msg), 0, 0, 0 };
+
+    write_all(fd, &response, sizeof(response));
+    write_all(fd, msg, strlen(msg));
+}
+
+// Renders the bands requested on fd until the coordinator closes it
+
+void
+serve_shard_requests(int fd)
+{
+    ShardRequest request;
+
+    while (read_all(fd, &request, sizeof(request)))
+    {
+        if (request.magic != SHARD_MAGIC || request.version != SHARD_VERSION)
+            return send_shard_error(fd, "Incompatible shard protocol");
+
+        if (request.type != CV_8UC4 && request.type != CV_64FC4)
+            return send_shard_error(fd, "Unsupported input type");
+
+        if (request.width <= 0 || request.height <= 0 ||
+            request.width > SHARD_MAX_SIDE || request.height > SHARD_MAX_SIDE ||
+            (int64_t) request.width * request.height > SHARD_MAX_PIXELS ||
+            request.effect_width <= 0 || request.effect_height <= 0 ||
+            request.effect_width > SHARD_MAX_SIDE || request.effect_height > SHARD_MAX_SIDE ||
+            (int64_t) request.effect_width * request.effect_height > SHARD_MAX_PIXELS ||
+            request.block_size < 0 || request.block_size > SHARD_MAX_SIDE ||
+            request.first_row < 0 || request.first_row >= request.last_row ||
+            request.last_row > request.height ||
+            request.input_first < 0 || request.input_first >= request.height ||
+            request.input_count < 0 || request.input_count > request.height ||
+            request.effect_first < 0 || request.effect_first >= request.effect_height ||
+            request.effect_count < 0 || request.effect_count > request.effect_height)
+            return send_shard_error(fd, "Invalid shard dimensions");
+
+        VanGoghLIC lic;
+
+        lic.filter_length     = request.filter_length;
+        lic.noise_magnitude   = request.noise_magnitude;
+        lic.integration_steps = request.integration_steps;
+        lic.minimum_value     = request.minimum_value;
+        lic.maximum_value     = request.maximum_value;
+        lic.effect_channel    = (EffectChannel) request.effect_channel;
+        lic.effect_operator   = (EffectOperator) request.effect_operator;
+        lic.convolve_with     = (ConvolveWith) request.convolve_with;
+        lic.effect_scaling    = (EffectScaling) request.effect_scaling;
+        lic.streamline        = (Streamline) request.streamline;
+        lic.streamline_tolerance = request.streamline_tolerance;
+        lic.image_layout      = (ImageLayout) request.image_layout;
+        lic.input_alpha       = (InputAlpha) request.input_alpha;
+        lic.arithmetic        = (Arithmetic) request.arithmetic;
+        lic.output_depth      = (OutputDepth) request.output_depth;
+        lic.quantization      = (Quantization) request.quantization;
+        lic.traversal         = (Traversal) request.traversal;
+        lic.block_size        = request.block_size;
+        lic.num_threads       = CLAMP(request.num_threads, 1,
+                                      std::max((int) std::thread::hardware_concurrency(), 1));
+        lic.instruction_set   = (InstructionSet) request.instruction_set;
+
+        std::vector<guchar> scalarfield((size_t) request.effect_width * request.effect_height);
+        cv::Mat field(request.effect_height, request.effect_width, CV_8UC1, scalarfield.data());
+
+        int output_type = lic.output_type(request.type);
+
+        try
+        {
+            ShardCanvas input(request.height, request.width, request.type);
+            ShardCanvas output(request.height, request.width, output_type);
+
+            if (!read_rows(fd, field, request.effect_first, request.effect_count) ||
+                !read_rows(fd, input.image, request.input_first, request.input_count))
+                return;
+
+            lic.prepare(scalarfield, request.effect_width, request.effect_height);
+            lic.render(input.image, output.image, request.first_row, request.last_row);
+
+            ShardResponse response = { SHARD_MAGIC, 0, output_type,
+                                       request.first_row, request.last_row };
+
+            if (!write_all(fd, &response, sizeof(response)) ||
+                !write_rows(fd, output.image, request.first_row, request.last_row - request.first_row))
+                return;
+        }
+        catch (std::exception & e)
+        {
+            return send_shard_error(fd, e.what());
+        }
+    }
+}
+
+// Accepts coordinators on address:port forever, one at a time.
+// address is an IPv4 address, 127.0.0.1 to only serve this machine
+
+void
+serve_shards(const char * bind_address, int port)
+{
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int enable = 1;
+
+    if (server < 0)
+        throw std::runtime_error("Failed to create the shard socket");
+
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, bind_address, &address.sin_addr) != 1)
+        throw std::runtime_error(std::string("Invalid shard bind address - ") + bind_address);
+
+    if (bind(server, (sockaddr *) &address, sizeof(address)) < 0 || listen(server, 16) < 0)
+        throw std::runtime_error("Failed to listen on the shard port");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while (true)
+    {
+        int client = accept(server, nullptr, nullptr);
+
+        if (client < 0)
+            continue;
+
+        serve_shard_requests(client);
+        close(client);
+    }
+}
+
+
+/***************/
+/* Coordinator */
+/***************/
+
+class ShardCoordinator
+{
+private:
+
+    std::vector<int> sockets;
+    std::vector<pid_t> children;
+
+public:
+
+    ~ShardCoordinator() {
+        for (int fd : sockets)
+            close(fd);
+
+        for (pid_t pid : children)
+            waitpid(pid, nullptr, 0);
+    }
+
+    bool empty() {
+        return sockets.empty();
+    }
+
+    // Call it before loading the images, so that the workers do not
+    // inherit a copy of them
+
+    void
+    spawnLocal(int count) {
+        signal(SIGPIPE, SIG_IGN);
+
+        for (int i = 0; i < count; ++i)
+        {
+            int pair[2];
+
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+                throw std::runtime_error("Failed to create the shard sockets");
+
+            pid_t pid = fork();
+
+            if (pid < 0)
+                throw std::runtime_error("Failed to fork a shard worker");
+
+            if (pid == 0)
+            {
+                for (int fd : sockets)
+                    close(fd);
+
+                close(pair[0]);
+                serve_shard_requests(pair[1]);
+                _exit(0);
+            }
+
+            close(pair[1]);
+            sockets.push_back(pair[0]);
+            children.push_back(pid);
+        }
+    }
+
+    // hosts is a comma separated list of host:port
+
+    void
+    connectRemote(const char * hosts) {
+        signal(SIGPIPE, SIG_IGN);
+
+        std::stringstream list(hosts);
+        std::string item;
+
+        while (std::getline(list, item, ','))
+        {
+            size_t colon = item.rfind(':');
+
+            if (colon == std::string::npos)
+                throw std::runtime_error(std::string("Expected host:port - ") + item);
+
+            std::string host = item.substr(0, colon);
+            std::string port = item.substr(colon + 1);
+
+            addrinfo hints;
+            addrinfo * found = nullptr;
+
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+                throw std::runtime_error(std::string("Failed to resolve shard host - ") + item);
+
+            int fd = -1;
+
+            for (addrinfo * it = found; it != nullptr && fd < 0; it = it->ai_next)
+            {
+                fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+
+                if (fd >= 0 && connect(fd, it->ai_addr, it->ai_addrlen) < 0)
+                {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+
+            freeaddrinfo(found);
+
+            if (fd < 0)
+                throw std::runtime_error(std::string("Failed to connect to shard host - ") + item);
+
+            sockets.push_back(fd);
+        }
+    }
+
+    // lic must be prepared, from an effect image or a cache file
+
+    void
+    render(VanGoghLIC & lic, cv::Mat & input_image, cv::Mat & output_image) {
+        int field_width;
+        int field_height;
+        const guchar * scalarfield = lic.get_scalarfield(field_width, field_height);
+
+        if (scalarfield == nullptr)
+            throw std::runtime_error("ShardCoordinator::render requires a prepared VanGoghLIC");
+
+        cv::Mat field(field_height, field_width, CV_8UC1, (void *) scalarfield);
+
+        int height = input_image.rows;
+        int halo = lic.halo_rows();
+        int shards = std::min((int) sockets.size(), height);
+        InputAlpha input_alpha = lic.detect_alpha(input_image);
+
+        // Send every band before reading any result, so that all
+        // workers run at the same time
+
+        for (int i = 0; i < shards; ++i)
+        {
+            ShardRequest request;
+            memset(&request, 0, sizeof(request));
+
+            request.magic             = SHARD_MAGIC;
+            request.version           = SHARD_VERSION;
+            request.filter_length     = lic.filter_length;
+            request.noise_magnitude   = lic.noise_magnitude;
+            request.integration_steps = lic.integration_steps;
+            request.minimum_value     = lic.minimum_value;
+            request.maximum_value     = lic.maximum_value;
+            request.effect_channel    = lic.effect_channel;
+            request.effect_operator   = lic.effect_operator;
+            request.convolve_with     = lic.convolve_with;
+            request.effect_scaling    = lic.effect_scaling;
+            request.streamline        = lic.streamline;
+            request.streamline_tolerance = lic.streamline_tolerance;
+            request.image_layout      = lic.image_layout;
+            request.input_alpha       = input_alpha;
+            request.arithmetic        = lic.arithmetic;
+            request.output_depth      = lic.output_depth;
+            request.quantization      = lic.quantization;
+            request.traversal         = lic.traversal;
+            request.block_size        = CLAMP(lic.block_size, 0, SHARD_MAX_SIDE);  // larger tiles are cut to the image
+            request.num_threads       = lic.num_threads;
+            request.instruction_set   = lic.instruction_set;
+
+            request.width         = input_image.cols;
+            request.height        = height;
+            request.type          = input_image.type();
+            request.first_row     = (int64) height * i / shards;
+            request.last_row      = (int64) height * (i + 1) / shards;
+            request.input_count   = std::min(request.last_row - request.first_row + 2 * halo, height);
+            request.input_first   = request.input_count == height ? 0 :
+                                    ((request.first_row - halo) % height + height) % height;
+
+            request.effect_width  = field.cols;
+            request.effect_height = field.rows;
+
+            // A stretched field is small, it is sent whole. Curved
+            // streamlines read the field as far as the input halo, at
+            // rows that wrap around the output before the tiled field:
+            // past the edges of the output, they only follow on in the
+            // field when its height divides the output's, and the whole
+            // field is sent otherwise
+
+            int field_halo = lic.streamline == CURVED ? halo + 1 : 1;
+            bool field_wraps = lic.streamline == CURVED && height % field.rows != 0 &&
+                               (request.first_row < halo || request.last_row + halo > height);
+
+            request.effect_count  = lic.effect_scaling == STRETCH || field_wraps ? field.rows :
+                                    std::min(request.last_row - request.first_row + 2 * field_halo, field.rows);
+            request.effect_first  = request.effect_count == field.rows ? 0 :
+                                    ((request.first_row - field_halo) % field.rows + field.rows) % field.rows;
+
+            if (!write_all(sockets[i], &request, sizeof(request)) ||
+                !write_rows(sockets[i], field, request.effect_first, request.effect_count) ||
+                !write_rows(sockets[i], input_image, request.input_first, request.input_count))
+                throw std::runtime_error("Failed to send a band to a shard worker");
+        }
+
+        // Stitch the bands together
+
+        for (int i = 0; i < shards; ++i)
+        {
+            ShardResponse response;
+
+            if (!read_all(sockets[i], &response, sizeof(response)) || response.magic != SHARD_MAGIC)
+                throw std::runtime_error("Lost the connection to a shard worker");
+
+            if (response.status != 0)
+            {
+                std::string msg(response.status, ' ');
+                read_all(sockets[i], &msg[0], msg.size());
+                throw std::runtime_error(std::string("Shard worker failed - ") + msg);
+            }
+
+            output_image.create(input_image.rows, input_image.cols, response.type);
+
+            if (!read_rows(sockets[i], output_image, response.first_row, response.last_row - response.first_row))
+                throw std::runtime_error("Lost the connection to a shard worker");
+        }
+    }
+
+};
+
+#endif /* VGLIC_SHARDING_HPP */
@@ -0,0 +1,30 @@
+#include "validation.hpp"
+
+#include <cstdlib>
+#include <iostream>
+
+// vglic_test [CASES]
+//
+// Compares every path of VanGoghLIC with the frozen reference port on
+// CASES (100 by default) random images and parameters. Kept out of vglic
+// so that the reference is not shipped with the tool.
+//
+// Exits with 1 when a path is out of tolerance.
+
+int main(int argc, char * argv[])
+{
+    int cases = 100;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (argv[i][0] != '-' && atoi(argv[i]) > 0)
+            cases = atoi(argv[i]);
+        else
+        {
+            std::cout << "Unexpected parameter - " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    return run_validation(cases) ? 0 : 1;
+}
@@ -0,0 +1,562 @@
+/* Differential validation for vglic_test (test.cpp)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Renders random images with random parameters through ReferenceLIC (the
+ * original port, see reference_lic.hpp) and through every path of
+ * VanGoghLIC, and reports for each path the largest difference to the
+ * reference, in units of the [0, 1] color range, next to its tolerance
+ * and its speedup over the reference. Paths that promise the same result
+ * as a plainer render of VanGoghLIC (several variants at once, or video
+ * frames that only re-render what changed) are compared with, and timed
+ * against, that render instead.
+ *
+ * Input colors are multiples of 1/255, so that the paths reading 8 bit
+ * inputs see exactly the same image as the others.
+ */
+
+#ifndef VGLIC_VALIDATION_HPP
+#define VGLIC_VALIDATION_HPP
+
+#include "vglic.hpp"
+#include "reference_lic.hpp"
+#include "sharding.hpp"
+#include "vglic_video.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+struct ValidationCase
+{
+    double filter_length;
+    double noise_magnitude;
+    double integration_steps;
+    double minimum_value;
+    double maximum_value;
+    EffectChannel effect_channel;
+    EffectOperator effect_operator;
+    ConvolveWith convolve_with;
+
+    cv::Mat input_8u;
+    cv::Mat input_64f;
+    cv::Mat effect_64f;
+    cv::Mat reference;
+};
+
+// What a path is compared with
+
+enum ValidationCheck
+{
+    AGAINST_REFERENCE,                    // the output of ReferenceLIC
+    AGAINST_VARIANTS,                     // each variant rendered on its own
+    AGAINST_FULL_FRAME,                   // a video frame rendered whole
+    AGAINST_ONE_PROCESS,                  // the image rendered without shards
+    AGAINST_SYNCHRONOUS,                  // compute, for jobs of compute_async
+    REJECTED                              // render must throw invalid_argument
+};
+
+struct ValidationPath
+{
+    const char * name;
+    double tolerance;
+    bool input_8u;
+    int bands;                            // render calls, or shard workers
+    void (*configure)(VanGoghLIC & lic);
+    ValidationCheck check;
+
+    int cases;
+    double max_error;
+    double seconds;
+    double baseline_seconds;              // of what it is compared with, if not the reference
+    int failed_cases;                     // that broke another check of the path
+    const char * failure;                 // the last of them
+};
+
+void
+make_validation_case(std::mt19937 & random, ValidationCase & test)
+{
+    std::uniform_int_distribution<int> size(8, 80);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    int width = size(random);
+    int height = size(random);
+    bool translucent = uniform(random) < 0.5;
+
+    // Half of the effect images are tiled over the input
+
+    int effect_width = uniform(random) < 0.5 ? width : size(random);
+    int effect_height = uniform(random) < 0.5 ? height : size(random);
+
+    test.filter_length = 0.05 + uniform(random) * 30.0;
+    test.noise_magnitude = 0.5 + uniform(random) * 20.0;
+    test.integration_steps = std::uniform_int_distribution<int>(2, 60)(random);
+    test.minimum_value = -5.0 - uniform(random) * 55.0;
+    test.maximum_value = 5.0 + uniform(random) * 55.0;
+    test.effect_channel = (EffectChannel) std::uniform_int_distribution<int>(0, 2)(random);
+    test.effect_operator = uniform(random) < 0.5 ? GRADIENT : DERIVATIVE;
+    test.convolve_with = uniform(random) < 0.2 ? WHITE_NOISE : SOURCE_IMAGE;
+
+    test.input_8u.create(height, width, CV_8UC4);
+
+    for (int y = 0; y < height; ++y)
+    {
+        guchar * row = test.input_8u.ptr<guchar>(y);
+
+        for (int x = 0; x < width * 4; ++x)
+            row[x] = (x % 4 == 3 && !translucent) ? 255 : byte(random);
+    }
+
+    test.input_8u.convertTo(test.input_64f, CV_64FC4, 1.0 / 255.0);
+
+    test.effect_64f.create(effect_height, effect_width, CV_64FC4);
+
+    for (int y = 0; y < effect_height; ++y)
+    {
+        GimpRGBA * row = test.effect_64f.ptr<GimpRGBA>(y);
+
+        for (int x = 0; x < effect_width; ++x)
+        {
+            for (int c = 0; c < 3; ++c)
+                row[x][c] = uniform(random);
+
+            row[x][3] = 1.0;
+        }
+    }
+}
+
+template <typename LIC>
+void
+set_validation_parameters(LIC & lic, ValidationCase & test)
+{
+    lic.filter_length = test.filter_length;
+    lic.noise_magnitude = test.noise_magnitude;
+    lic.integration_steps = test.integration_steps;
+    lic.minimum_value = test.minimum_value;
+    lic.maximum_value = test.maximum_value;
+    lic.effect_channel = test.effect_channel;
+    lic.effect_operator = test.effect_operator;
+    lic.convolve_with = test.convolve_with;
+}
+
+// The largest difference of any channel, with both images scaled to [0, 1]
+
+void
+to_unit_range(cv::Mat & image, cv::Mat & image_64f)
+{
+    double scale = image.depth() == CV_8U ? 1.0 / 255.0 :
+                   image.depth() == CV_16U ? 1.0 / 65535.0 : 1.0;
+
+    image.convertTo(image_64f, CV_64FC4, scale);
+}
+
+double
+validation_error(cv::Mat & output, cv::Mat & reference)
+{
+    cv::Mat output_64f;
+    cv::Mat reference_64f;
+
+    to_unit_range(output, output_64f);
+    to_unit_range(reference, reference_64f);
+
+    return cv::norm(output_64f, reference_64f, cv::NORM_INF);
+}
+
+double
+seconds_since(int64 start)
+{
+    return (cv::getTickCount() - start) / cv::getTickFrequency();
+}
+
+// Renders variants of the parameters of the case in one pass: twice the 
+// filter length with the same number of steps (rounded up to an even one, 
+// so that every other sample lines up) for both operators, and twice the 
+// length with twice the steps, whose samples include all of the case's. 
+// Each output is compared with a render of its variant alone, with the 
+// same instance as the variants use. Interleaved SOURCE_IMAGE cases must 
+// take the shared path, which reads fewer samples per pixel than the 
+// single renders do on average.
+
+void
+run_variants_path(ValidationPath & path, ValidationCase & test, VanGoghLIC & lic, cv::Mat & input)
+{
+    EffectOperator other = test.effect_operator == GRADIENT ? DERIVATIVE : GRADIENT;
+    double length = test.filter_length;
+    double steps = 2 * std::ceil(test.integration_steps / 2);
+    std::vector<RenderVariant> variants;
+    std::vector<cv::Mat> outputs;
+    cv::Mat single;
+    double single_samples = 0;
+
+    variants.push_back({ length, steps, test.effect_operator });
+    variants.push_back({ length * 2, steps, test.effect_operator });
+    variants.push_back({ length * 2, steps * 2, test.effect_operator });
+    variants.push_back({ length, steps, other });
+    variants.push_back({ length * 2, steps, other });
+
+    lic.prepare(test.effect_64f);
+
+    int64 start = cv::getTickCount();
+    lic.render(input, variants, outputs, 0, input.rows);
+    path.seconds += seconds_since(start);
+
+    double shared_samples = lic.samples_per_pixel();
+
+    for (size_t i = 0; i < variants.size(); ++i)
+    {
+        lic.filter_length = variants[i].filter_length;
+        lic.integration_steps = variants[i].integration_steps;
+        lic.effect_operator = variants[i].effect_operator;
+
+        start = cv::getTickCount();
+        lic.render(input, single, 0, input.rows);
+        path.baseline_seconds += seconds_since(start);
+
+        single_samples += lic.samples_per_pixel() / variants.size();
+        path.max_error = std::max(path.max_error, validation_error(outputs[i], single));
+    }
+
+    if (lic.convolve_with == SOURCE_IMAGE && shared_samples >= single_samples)
+    {
+        path.failed_cases += 1;
+        path.failure = "samples not shared";
+    }
+}
+
+// Renders the input as the first frame of a video, then a second frame 
+// with the colors of a rectangle inverted, which VanGoghLICVideo only 
+// re-renders around the rectangle. The second frame is compared with a 
+// render of it whole.
+
+void
+run_video_path(ValidationPath & path, ValidationCase & test, VanGoghLIC & lic)
+{
+    VanGoghLICVideo video(lic);
+    cv::Mat second_8u = test.input_8u.clone();
+    cv::Mat first, second, output, whole;
+    int x0 = second_8u.cols / 3, x1 = x0 + std::max(second_8u.cols / 4, 1);
+    int y0 = second_8u.rows / 3, y1 = y0 + std::max(second_8u.rows / 4, 1);
+
+    for (int y = y0; y < y1; ++y)
+    {
+        guchar * row = second_8u.ptr<guchar>(y);
+
+        for (int x = x0 * 4; x < x1 * 4; ++x)
+            if (x % 4 != 3)
+                row[x] = 255 - row[x];
+    }
+
+    if (path.input_8u)
+    {
+        first = test.input_8u;
+        second = second_8u;
+    }
+    else
+    {
+        first = test.input_64f;
+        second_8u.convertTo(second, CV_64FC4, 1.0 / 255.0);
+    }
+
+    lic.prepare(test.effect_64f);
+    video.compute(first, output);
+
+    int64 start = cv::getTickCount();
+    video.compute(second, output);
+    path.seconds += seconds_since(start);
+
+    start = cv::getTickCount();
+    lic.render(second, whole, 0, second.rows);
+    path.baseline_seconds += seconds_since(start);
+
+    path.max_error = std::max(path.max_error, validation_error(output, whole));
+}
+
+// Renders the input in bands of rows, each in a worker process forked for 
+// the case, as vglic --shards does, and compares the stitched image with 
+// a render of it in this process.
+
+void
+run_shards_path(ValidationPath & path, ValidationCase & test, VanGoghLIC & lic, cv::Mat & input)
+{
+    ShardCoordinator shards;
+    cv::Mat output, whole;
+
+    shards.spawnLocal(path.bands);
+    lic.prepare(test.effect_64f);
+
+    int64 start = cv::getTickCount();
+    shards.render(lic, input, output);
+    path.seconds += seconds_since(start);
+
+    start = cv::getTickCount();
+    lic.render(input, whole, 0, input.rows);
+    path.baseline_seconds += seconds_since(start);
+
+    path.max_error = std::max(path.max_error, validation_error(output, whole));
+}
+
+// Starts one job per priority on the shared pool at once, with half, one 
+// and twice the filter length of the case, and a job that must fail (fixed 
+// point refuses to dither). Each output is compared with compute on the 
+// same instance, and the future of the failing job must rethrow its error.
+
+void
+run_async_path(ValidationPath & path, ValidationCase & test, VanGoghLIC & lic, cv::Mat & input)
+{
+    const TaskPriority priorities[] = { PRIORITY_BATCH, PRIORITY_NORMAL, PRIORITY_INTERACTIVE };
+    const int jobs = 3;
+    std::vector<VanGoghLIC> instances(jobs + 1, lic);
+    std::vector<cv::Mat> outputs(jobs + 1);
+    std::vector<std::future<void>> futures;
+    cv::Mat single;
+
+    for (int i = 0; i < jobs; ++i)
+        instances[i].filter_length = test.filter_length * (1 << i) / 2;
+
+    instances[jobs].arithmetic = FIXED_POINT;
+    instances[jobs].quantization = ORDERED_DITHER;
+
+    int64 start = cv::getTickCount();
+
+    for (int i = 0; i <= jobs; ++i)
+        futures.push_back(instances[i].compute_async(input, test.effect_64f, outputs[i],
+                                                     priorities[i % jobs]));
+
+    for (int i = 0; i <= jobs; ++i)
+    {
+        try
+        {
+            futures[i].get();
+
+            if (i == jobs)
+            {
+                path.failed_cases += 1;
+                path.failure = "error not rethrown";
+            }
+        }
+        catch (std::invalid_argument &)
+        {
+            if (i < jobs)
+            {
+                path.failed_cases += 1;
+                path.failure = "job failed";
+            }
+        }
+    }
+
+    path.seconds += seconds_since(start);
+
+    for (int i = 0; i < jobs; ++i)
+    {
+        start = cv::getTickCount();
+        instances[i].compute(input, test.effect_64f, single);
+        path.baseline_seconds += seconds_since(start);
+
+        path.max_error = std::max(path.max_error, validation_error(outputs[i], single));
+    }
+}
+
+void
+run_validation_path(ValidationPath & path, ValidationCase & test)
+{
+    VanGoghLIC lic;
+    cv::Mat output;
+    cv::Mat & input = path.input_8u ? test.input_8u : test.input_64f;
+
+    set_validation_parameters(lic, test);
+    path.configure(lic);
+
+    // Paths forcing an instruction set the cpu lacks are skipped
+
+    if (lic.instruction_set > VanGoghLIC::supported_instruction_set())
+        return;
+
+    path.cases += 1;
+
+    if (path.check == AGAINST_VARIANTS)
+    {
+        run_variants_path(path, test, lic, input);
+        return;
+    }
+
+    if (path.check == AGAINST_FULL_FRAME)
+    {
+        run_video_path(path, test, lic);
+        return;
+    }
+
+    if (path.check == AGAINST_ONE_PROCESS)
+    {
+        run_shards_path(path, test, lic, input);
+        return;
+    }
+
+    if (path.check == AGAINST_SYNCHRONOUS)
+    {
+        run_async_path(path, test, lic, input);
+        return;
+    }
+
+    if (path.check == REJECTED)
+    {
+        lic.prepare(test.effect_64f);
+
+        try
+        {
+            lic.render(input, output, 0, input.rows);
+            path.failed_cases += 1;
+            path.failure = "not rejected";
+        }
+        catch (std::invalid_argument &)
+        {
+        }
+
+        return;
+    }
+
+    int64 start = cv::getTickCount();
+
+    lic.prepare(test.effect_64f);
+
+    for (int band = 0; band < path.bands; ++band)
+    {
+        int first_row = input.rows * band / path.bands;
+        int last_row = input.rows * (band + 1) / path.bands;
+
+        if (first_row < last_row)
+            lic.render(input, output, first_row, last_row);
+    }
+
+    path.seconds += seconds_since(start);
+    path.max_error = std::max(path.max_error, validation_error(output, test.reference));
+}
+
+// Returns false when a path is farther from the reference than its tolerance.
+// The paths run with the best instruction set of the cpu, except the planar
+// and fixed point ones, the only kernels built for several, which run with
+// each of them in turn
+
+bool
+run_validation(int cases)
+{
+    // The tolerances are what each path is meant to guarantee: the double
+    // precision paths only reorder the sums, the float layout rounds to
+    // 24 bits, the 8 and 16 bit outputs round (or dither) once more, and
+    // the fixed point kernel, which 8 bit opaque inputs rounded to 8 bit
+    // outputs always use, is within 1 LSB of the rounded result at any
+    // output depth, and refuses to dither. Variants rendered together add
+    // up the same samples in the same order as a render of each, some of
+    // them read at offsets a rounding away, and the pixels a video frame
+    // re-renders, like the bands of shard workers, are the same as in a
+    // whole render.
+
+    const double rounding = 1e-9;
+
+    ValidationPath paths[] =
+    {
+        { "interleaved",       rounding,               false, 1, [](VanGoghLIC &) { } },
+        { "planar sse2",       1e-5,                   false, 1, [](VanGoghLIC & lic) { lic.image_layout = PLANAR; lic.instruction_set = ISA_SSE2; } },
+        { "planar avx2",       1e-5,                   false, 1, [](VanGoghLIC & lic) { lic.image_layout = PLANAR; lic.instruction_set = ISA_AVX2; } },
+        { "planar avx512",     1e-5,                   false, 1, [](VanGoghLIC & lic) { lic.image_layout = PLANAR; lic.instruction_set = ISA_AVX512; } },
+        { "blocked tiles",     rounding,               false, 1, [](VanGoghLIC & lic) { lic.traversal = BLOCKED; lic.block_size = 16; } },
+        { "z-order tiles",     rounding,               false, 1, [](VanGoghLIC & lic) { lic.traversal = Z_ORDER; lic.block_size = 16; } },
+        { "z-order one tile",  rounding,               false, 1, [](VanGoghLIC & lic) { lic.traversal = Z_ORDER; lic.block_size = 100000; } },
+        { "4 threads",         rounding,               false, 1, [](VanGoghLIC & lic) { lic.num_threads = 4; } },
+        { "3 bands",           rounding,               false, 3, [](VanGoghLIC &) { } },
+        { "8 bit output",      0.5 / 255 + rounding,   false, 1, [](VanGoghLIC & lic) { lic.output_depth = OUTPUT_8U; } },
+        { "16 bit output",     0.5 / 65535 + rounding, false, 1, [](VanGoghLIC & lic) { lic.output_depth = OUTPUT_16U; } },
+        { "ordered dither",    1.0 / 255 + rounding,   false, 1, [](VanGoghLIC & lic) { lic.output_depth = OUTPUT_8U; lic.quantization = ORDERED_DITHER; } },
+        { "8 bit input",       rounding,               true,  1, [](VanGoghLIC & lic) { lic.output_depth = OUTPUT_64F; } },
+        { "fixed point",       1.5 / 255 + rounding,   false, 1, [](VanGoghLIC & lic) { lic.arithmetic = FIXED_POINT; } },
+        { "fixed point sse2",  1.5 / 255 + rounding,   false, 1, [](VanGoghLIC & lic) { lic.arithmetic = FIXED_POINT; lic.instruction_set = ISA_SSE2; } },
+        { "fixed point 16U",   1.5 / 255 + rounding,   true,  1, [](VanGoghLIC & lic) { lic.arithmetic = FIXED_POINT; lic.output_depth = OUTPUT_16U; } },
+        { "fixed dither",      0,                      true,  1, [](VanGoghLIC & lic) { lic.arithmetic = FIXED_POINT; lic.quantization = ORDERED_DITHER; }, REJECTED },
+        { "8 bit in, 16U",     0.5 / 65535 + rounding, true,  1, [](VanGoghLIC & lic) { lic.output_depth = OUTPUT_16U; } },
+        { "8 bit in, dither",  1.0 / 255 + rounding,   true,  1, [](VanGoghLIC & lic) { lic.quantization = ORDERED_DITHER; } },
+        { "variants (shared)", rounding,               false, 1, [](VanGoghLIC &) { }, AGAINST_VARIANTS },
+        { "video straight",    0,                      false, 1, [](VanGoghLIC &) { }, AGAINST_FULL_FRAME },
+        { "video curved",      0,                      false, 1, [](VanGoghLIC & lic) { lic.streamline = CURVED; }, AGAINST_FULL_FRAME },
+        { "video fixed point", 0,                      true,  1, [](VanGoghLIC & lic) { lic.arithmetic = FIXED_POINT; }, AGAINST_FULL_FRAME },
+        { "video white noise", 0,                      false, 1, [](VanGoghLIC & lic) { lic.convolve_with = WHITE_NOISE; }, AGAINST_FULL_FRAME },
+        { "4 shards",          0,                      false, 4, [](VanGoghLIC &) { }, AGAINST_ONE_PROCESS },
+        { "4 shards curved",   0,                      false, 4, [](VanGoghLIC & lic) { lic.streamline = CURVED; }, AGAINST_ONE_PROCESS },
+        { "async jobs",        0,                      false, 1, [](VanGoghLIC &) { }, AGAINST_SYNCHRONOUS },
+    };
+
+    int path_count = sizeof(paths) / sizeof(paths[0]);
+    double reference_seconds = 0;
+    std::mt19937 random;
+
+    for (int i = 0; i < path_count; ++i)
+    {
+        paths[i].cases = 0;
+        paths[i].max_error = 0;
+        paths[i].seconds = 0;
+        paths[i].baseline_seconds = 0;
+        paths[i].failed_cases = 0;
+        paths[i].failure = nullptr;
+    }
+
+    for (int i = 0; i < cases; ++i)
+    {
+        ValidationCase test;
+        ReferenceLIC reference;
+
+        make_validation_case(random, test);
+        set_validation_parameters(reference, test);
+
+        int64 start = cv::getTickCount();
+        reference.compute(test.input_64f, test.effect_64f, test.reference);
+        reference_seconds += seconds_since(start);
+
+        for (int j = 0; j < path_count; ++j)
+            run_validation_path(paths[j], test);
+    }
+
+    bool ok = true;
+
+    printf("instruction set: %s\n", VanGoghLIC::instruction_set_name(VanGoghLIC::supported_instruction_set()));
+    printf("%-18s %6s %12s %12s %9s\n", "path", "cases", "max error", "tolerance", "speedup");
+
+    for (int i = 0; i < path_count; ++i)
+    {
+        if (paths[i].cases == 0)
+        {
+            printf("%-18s %6d %12s %12s %9s skipped, the cpu lacks its instruction set\n",
+                   paths[i].name, 0, "-", "-", "-");
+            continue;
+        }
+
+        bool path_ok = paths[i].max_error <= paths[i].tolerance && paths[i].failed_cases == 0;
+        double baseline = paths[i].check == AGAINST_REFERENCE ? reference_seconds : paths[i].baseline_seconds;
+
+        if (paths[i].check == REJECTED)
+            printf("%-18s %6d %12s %12s %9s %s\n", paths[i].name, paths[i].cases,
+                   "-", "-", "-", path_ok ? "rejected ok" : "FAILED");
+        else
+            printf("%-18s %6d %12.3g %12.3g %8.2fx %s\n", paths[i].name, paths[i].cases,
+                   paths[i].max_error, paths[i].tolerance,
+                   baseline / std::max(paths[i].seconds, 1e-9), path_ok ? "ok" : "FAILED");
+
+        if (paths[i].failed_cases > 0)
+            printf("%-18s %6d cases: %s\n", "", paths[i].failed_cases, paths[i].failure);
+
+        ok = ok && path_ok;
+    }
+
+    return ok;
+}
+
+#endif /* VGLIC_VALIDATION_HPP */